@@ -540,7 +540,7 @@ int main(int argc, char **argv) {
     boost::archive::binary_iarchive vocabularyArchive(vocabularyStream);
     vocabularyArchive >> histogramVocabulary;
     
-    m_gfpMatcher = new gflip_engine(kernel, m_neighborood, bag, bow_subtype, alpha_vss);
+    m_gfpMatcher = new gflip_engine(kernel, m_neighborood, bag, bow_subtype, alpha_vss, m_type);
     
     m_sensorReference.seek(0,END);
     unsigned int end = m_sensorReference.tell();
@@ -0,0 +1,223 @@
+//
+//
+// GFLIP - Geometrical FLIRT Phrases for Large Scale Place Recognition
+// Copyright (C) 2012-2013 Gian Diego Tipaldi and Luciano Spinello and Wolfram
+// Burgard
+//
+// This file is part of GFLIP.
+//
+// GFLIP is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GFLIP is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with GFLIP.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <gflip/gflip_engine.hpp>
+#include <iostream>
+#include <string.h>
+
+
+typedef struct
+{
+	int bow_subtype, queries, repeats, kbest;
+	std::string filein ;
+}sw_param_str;
+
+static const char *kernel_name[] = {"auto", "scalar", "SSE4.1", "AVX2"};
+
+//~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~
+
+void program_info(void)
+{
+	std::cout << "-i BOW input file" << std::endl;
+	std::cout << "-st {0: standard TFIDF [DEFAULT], 1: sublinear TFIDF scaling, 2: lenght smoothing TFIDF}" << std::endl;
+	std::cout << "-q [1..N] number of scans used as queries, from the first one [1000 DEFAULT]" << std::endl;
+	std::cout << "-k [1..N] best matches retrieved [50 DEFAULT]" << std::endl;
+	std::cout << "-r [1..N] runs of the queries for each kernel and matcher [3 DEFAULT]" << std::endl;
+}
+
+//~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~
+
+int parse_command_line(int argc, char **argv, sw_param_str *sw_param)
+{
+	int i;
+
+	sw_param -> bow_subtype = 0;
+	sw_param -> queries = 1000;
+	sw_param -> repeats = 3;
+	sw_param -> kbest = 50;
+
+	for(i=0; i<argc; i++)
+	{
+		if(!strcmp(argv[i], "-i"))
+				sw_param -> filein = argv[i+1];
+
+		if(!strcmp(argv[i], "-st"))
+				sw_param -> bow_subtype = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-q"))
+				sw_param -> queries = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-k"))
+				sw_param -> kbest = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-r"))
+				sw_param -> repeats = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "--help"))
+		{
+			program_info();
+			exit(1);
+		}
+ 	}
+
+	if(!sw_param -> filein.size())
+	{
+		printf("Input filename missing\n");
+		exit(1);
+	}
+
+	std::cout << "[PAR] BOW input filename: "  << sw_param -> filein  << std::endl;
+	std::cout << "[PAR] TF-IDF flavour: "  << sw_param -> bow_subtype  << std::endl;
+	std::cout << "[PAR] kbest: "  << sw_param -> kbest  << std::endl;
+	return(1);
+}
+
+//~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~
+
+int main (int argc, char **argv)
+{
+	sw_param_str sw_param;
+	std::cout << std::endl;
+	std::cout << ">> Throughput of the bag-of-words scoring kernels and of the block-max WAND retrieval" << std::endl  << std::endl;
+	if(!parse_command_line(argc, argv, &sw_param))
+		exit(0);
+
+	class gflip_engine gfp (2, sw_param.kbest, 0, sw_param.bow_subtype, DEFAULT_ALPHASMOOTH, 1);
+	int ret = gfp.read_wordscan_file(sw_param.filein);
+	std::cout << "Read FLIRT word scans: " << ret << std::endl;
+	gfp.prepare();
+
+	int nq = std::min(sw_param.queries, gfp.get_num_scans());
+	query_context ctx;
+	std::vector < std::vector < std::pair <double, int> > > reference (nq);
+	double scalar_rate = 0;
+	for(int k=1;k<=3;k++)
+	{
+		gfp.set_bow_kernel(k);
+		if(gfp.get_bow_kernel() != k)
+		{
+			std::cout << kernel_name[k] << ": not supported by this CPU" << std::endl;
+			continue;
+		}
+
+		//~ best of the runs
+		double best_time = DBL_MAX;
+		long num_postings = 0;
+		int mismatches = 0;
+		for(int r=0;r<sw_param.repeats;r++)
+		{
+			struct timeval tim_st;
+			gettimeofday(&tim_st, NULL);
+			num_postings = 0;
+			for(int i=0;i<nq;i++)
+			{
+				gfp.query(1, gfp.get_wordscan(i), ctx);
+				num_postings += ctx.get_num_postings();
+				if(k == 1 && r == 0)
+					reference[i] = ctx.results();
+				else if(r == 0 && ctx.results() != reference[i])
+					mismatches++;
+			}
+			best_time = std::min(best_time, elapsed_since(tim_st));
+		}
+		double rate = num_postings / best_time;
+		if(k == 1)
+			scalar_rate = rate;
+		std::cout << kernel_name[k] << ": " << nq << " queries, " << num_postings << " postings in " << best_time << " s, " << rate / 1e6 << " M postings/s"
+				  << ", speedup over scalar: " << rate / scalar_rate << ", queries with different results: " << mismatches << std::endl;
+	}
+	std::cout << "Kernel used by default: " << kernel_name[gflip_engine (2, 50).get_bow_kernel()] << std::endl;
+
+	//~ kbest retrieval with block-max WAND against the exhaustive matcher with the default kernel
+	class gflip_engine wand (2, sw_param.kbest, 0, sw_param.bow_subtype, DEFAULT_ALPHASMOOTH, 1);
+	wand.set_bow_block_max(true);
+	wand.read_wordscan_file(sw_param.filein);
+	wand.prepare();
+	gfp.set_bow_kernel(0);
+	double time[2] = {DBL_MAX, DBL_MAX};
+	long num_blocks = 0, num_skipped_blocks = 0;
+	int mismatches = 0;
+	for(int m=0;m<2;m++)
+		for(int r=0;r<sw_param.repeats;r++)
+		{
+			struct timeval tim_st;
+			gettimeofday(&tim_st, NULL);
+			for(int i=0;i<nq;i++)
+			{
+				(m ? wand : gfp).query(1, gfp.get_wordscan(i), ctx);
+				if(r > 0)
+					continue;
+				if(!m)
+				{
+					reference[i] = ctx.results();
+					continue;
+				}
+				num_blocks += ctx.get_num_blocks();
+				num_skipped_blocks += ctx.get_num_skipped_blocks();
+				
+				//~ same kbest scores, the documents of equal scores may differ
+				uint k = std::min(reference[i].size(), (size_t)sw_param.kbest);
+				bool same = ctx.results().size() == k;
+				for(uint j=0;same && j<k;j++)
+					same = ctx.results()[j].first == reference[i][j].first;
+				mismatches += !same;
+			}
+			time[m] = std::min(time[m], elapsed_since(tim_st));
+		}
+	std::cout << "Block-max WAND: " << 1000 * time[1] / nq << " ms/query against " << 1000 * time[0] / nq << " ms/query exhaustive, speedup: " << time[0] / time[1] 
+			  << ", skipped " << num_skipped_blocks << " of " << num_blocks << " posting blocks (" << 100.0 * num_skipped_blocks / std::max(1L, num_blocks) << "%)" 
+			  << ", queries with different kbest scores: " << mismatches << std::endl;
+
+	//~ scans with words unseen by the build, inserted in both engines and used as queries
+	int num_words = 0;
+	for(int i=0;i<gfp.get_num_scans();i++)
+		for(uint j=0;j<gfp.get_wordscan(i).size();j++)
+			num_words = std::max(num_words, gfp.get_wordscan(i)[j] + 1);
+	int ni = std::min(nq, 100);
+	std::vector < std::vector <int> > inserted (ni);
+	gfp.set_max_stale_fraction(-1);
+	wand.set_max_stale_fraction(-1);
+	for(int i=0;i<ni;i++)
+	{
+		inserted[i] = gfp.get_wordscan(i);
+		for(uint j=0;j<inserted[i].size();j+=2)
+			inserted[i][j] = num_words + (i + j) % 16;
+		std::vector <double> pos (inserted[i].size(), 0);
+		gfp.insert_wordscan(inserted[i], pos, pos);
+		wand.insert_wordscan(inserted[i], pos, pos);
+	}
+	mismatches = 0;
+	for(int i=0;i<ni;i++)
+	{
+		gfp.query(1, inserted[i], ctx);
+		reference[i] = ctx.results();
+		wand.query(1, inserted[i], ctx);
+		uint k = std::min(reference[i].size(), (size_t)sw_param.kbest);
+		bool same = ctx.results().size() == k;
+		for(uint j=0;same && j<k;j++)
+			same = ctx.results()[j].first == reference[i][j].first;
+		mismatches += !same;
+	}
+	std::cout << "Block-max WAND after inserting " << ni << " scans with new words: queries with different kbest scores: " << mismatches << std::endl;
+	std::cout << "done." << std::endl;
+}
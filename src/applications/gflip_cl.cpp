@@ -26,11 +26,12 @@
 
 typedef struct
 {
-	double meters,angle,alpha_vss;
-	int type,kernel, kbest,bow_subtype;
-	char bag;
+	double meters,angle,alpha_vss,gfp_pruning,prune_idf,prune_df;
+	int type,kernel, kbest,bow_subtype,threads,gfp_engine,gfp_memory,quantisation;
+	char bag, prune_report, block_max;
 	std::string filein ;
 	std::string outdir;
+	std::string indexin, indexout;
 }sw_param_str;
 
 //~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ 
@@ -44,6 +45,18 @@ void program_info(void)
 	std::cout << "-k [2..N] GFP kernel size [2 DEFAULT] (used only with -t 2) " << std::endl;
 	std::cout << "-b bag of distance words (histograms of pairwise distances) [NO DEFAULT]" << std::endl;
 	std::cout << "-kbest [0..N] returns best k results for each query [50 DEFAULT]" << std::endl;
+	std::cout << "-j [0..N] threads used to read the word scans, build the index and run the queries, 0 for all cores [1 DEFAULT]; with -t 2 and the dense GFP engine " 
+			  << "every query thread keeps (scans x longest scan) rows of 12 bytes, the threads are reduced to fit -gfpmem (the size is printed before the queries)" << std::endl;
+	std::cout << "-gfpmem [0..N] megabytes of dense GFP rows of all the query threads together, 0 for no bound [4096 DEFAULT]" << std::endl;
+	std::cout << "-gfpengine {0: dense rows [DEFAULT], 1: radix sorted hit stream} accumulation of GFP scores (used only with -t 2)" << std::endl;
+	std::cout << "-gfpprune [0..1] fraction of essential query words for exact score bound pruning of the kbest GFP matches with the dense engine, 0 disables it [0 DEFAULT]" << std::endl;
+	std::cout << "-prune_idf [0..N] drops from the index the postings of the words whose idf is under this value [0 DEFAULT]" << std::endl;
+	std::cout << "-prune_df [0..1] drops from the index the postings of the words in more than this fraction of the scans [1 DEFAULT]" << std::endl;
+	std::cout << "-quant {8, 16} stores the bag-of-words weights as fixed point values of this many bits, the index cannot be saved [double weights DEFAULT]" << std::endl;
+	std::cout << "-bmw retrieves only the kbest bag-of-words matches with block-max WAND, same kbest scores as the exhaustive matcher (used only with -t 1, not with -quant)" << std::endl;
+	std::cout << "-prune_report also builds the index without pruning nor quantisation and reports the postings removed, the index size and how many of its kbest results the pruned or quantised index keeps" << std::endl;
+	std::cout << "-load index file to use instead of building the index (same -t -k -b -st -alpha as when saved)" << std::endl;
+	std::cout << "-save index file to write after building the index" << std::endl;
 }
 
 //~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ 
@@ -59,6 +72,15 @@ int parse_command_line(int argc, char **argv, sw_param_str *sw_param)
 	sw_param -> kbest = 50;
 	sw_param ->  bow_subtype = 0;
 	sw_param ->  alpha_vss = 0.4;
+	sw_param ->  threads = 1;
+	sw_param ->  gfp_engine = 0;
+	sw_param ->  gfp_memory = DEFAULT_GFPROWMEMORY;
+	sw_param ->  gfp_pruning = 0;
+	sw_param ->  prune_idf = 0;
+	sw_param ->  prune_df = 1;
+	sw_param ->  quantisation = 0;
+	sw_param ->  prune_report = 0;
+	sw_param ->  block_max = 0;
 
 	for(i=0; i<argc; i++)
 	{
@@ -91,6 +113,39 @@ int parse_command_line(int argc, char **argv, sw_param_str *sw_param)
 		if(!strcmp(argv[i], "-kbest"))		
 				sw_param -> kbest = atoi(argv[i+1]);
 
+		if(!strcmp(argv[i], "-j"))		
+				sw_param -> threads = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-gfpengine"))		
+				sw_param -> gfp_engine = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-gfpmem"))		
+				sw_param -> gfp_memory = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-gfpprune"))		
+				sw_param -> gfp_pruning = atof(argv[i+1]);
+
+		if(!strcmp(argv[i], "-prune_idf"))		
+				sw_param -> prune_idf = atof(argv[i+1]);
+
+		if(!strcmp(argv[i], "-prune_df"))		
+				sw_param -> prune_df = atof(argv[i+1]);
+
+		if(!strcmp(argv[i], "-quant"))		
+				sw_param -> quantisation = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-bmw"))		
+				sw_param -> block_max = 1;
+
+		if(!strcmp(argv[i], "-prune_report"))		
+				sw_param -> prune_report = 1;
+
+		if(!strcmp(argv[i], "-load"))		
+				sw_param -> indexin = argv[i+1];
+
+		if(!strcmp(argv[i], "-save"))		
+				sw_param -> indexout = argv[i+1];
+
  	}
 			
 			
@@ -149,13 +204,44 @@ int main (int argc, char **argv)
 	if(!parse_command_line(argc, argv, &sw_param))
 		exit(0);
 	
-	class gflip_engine gfp (sw_param.kernel, sw_param.kbest, sw_param.bag, sw_param.bow_subtype, sw_param.alpha_vss);
+	class gflip_engine gfp (sw_param.kernel, sw_param.kbest, sw_param.bag, sw_param.bow_subtype, sw_param.alpha_vss, sw_param.type);
 
+	gfp.set_num_threads(sw_param.threads);
+	gfp.set_word_pruning(sw_param.prune_idf, sw_param.prune_df);
+	gfp.set_bow_quantisation(sw_param.quantisation);
+	gfp.set_bow_block_max(sw_param.block_max);
 	int ret2 = gfp.read_wordscan_file(sw_param.filein);
 	std::cout << "Read FLIRT word scans: " << ret2 << std::endl;
 	 	
-	std::cout << "Preparing inverted file index and TF-IDF" << std::endl;
-	gfp.prepare( );
+	if(sw_param.indexin.size())
+	{
+		std::cout << "Loading inverted file index and TF-IDF" << std::endl;
+		if(!gfp.load_index(sw_param.indexin))
+			exit(1);
+	}
+	else
+	{
+		std::cout << "Preparing inverted file index and TF-IDF" << std::endl;
+		gfp.prepare( );
+	}
+	if(sw_param.indexout.size() && !gfp.save_index(sw_param.indexout))
+		exit(1);
+	gfp.set_gfp_engine(sw_param.gfp_engine);
+	gfp.set_gfp_row_memory(sw_param.gfp_memory);
+	gfp.set_gfp_pruning(sw_param.gfp_pruning);
+	
+	if(sw_param.prune_report)
+	{
+		std::cout << "Preparing the index without pruning nor quantisation for the report" << std::endl;
+		class gflip_engine reference (sw_param.kernel, sw_param.kbest, sw_param.bag, sw_param.bow_subtype, sw_param.alpha_vss, sw_param.type);
+		reference.set_num_threads(sw_param.threads);
+		reference.read_wordscan_file(sw_param.filein);
+		reference.prepare();
+		std::cout << "Pruning removed " << reference.get_build_stats().num_postings - gfp.get_build_stats().num_postings << " of " << reference.get_build_stats().num_postings 
+				  << " postings, weights: " << (sw_param.quantisation ? std::to_string(sw_param.quantisation) + " bit" : std::string("double")) 
+				  << ", index size " << reference.get_build_stats().index_memory_bytes/1024 << " kB -> " << gfp.get_build_stats().index_memory_bytes/1024 
+				  << " kB, kbest results kept: " << 100.0 * gfp.topk_overlap(sw_param.type, reference) << "%" << std::endl;
+	}
 	
 	std::cout << "Start retreival of all scans vs all dataset " << std::endl;
 	gfp.run_evaluation(sw_param.type);
@@ -26,11 +26,12 @@
 
 typedef struct
 {
-	double meters,angle,alpha_vss;
-	int type,kernel, kbest,bow_subtype;
+	double meters,angle,alpha_vss,gfp_pruning;
+	int type,kernel, kbest,bow_subtype,threads,gfp_engine,shards,range_first,range_last;
 	char bag;
 	std::string filein ;
 	std::string outdir;
+	std::string indexin, indexout;
 }sw_param_str;
 
 //~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ 
@@ -44,6 +45,13 @@ void program_info(void)
 	std::cout << "-k [2..N] GFP kernel size [2 DEFAULT] (used only with -t 2) " << std::endl;
 	std::cout << "-b bag of distance words (histograms of pairwise distances) [NO DEFAULT]" << std::endl;
 	std::cout << "-kbest [0..N] returns best k results for each query [50 DEFAULT]" << std::endl;
+	std::cout << "-j [0..N] threads used to read the word scans and build the index, 0 for all cores [1 DEFAULT]" << std::endl;
+	std::cout << "-gfpengine {0: dense rows [DEFAULT], 1: radix sorted hit stream} accumulation of GFP scores (used only with -t 2)" << std::endl;
+	std::cout << "-gfpprune [0..1] fraction of essential query words for exact score bound pruning of the kbest GFP matches with the dense engine, 0 disables it [0 DEFAULT]" << std::endl;
+	std::cout << "-shards [1..N] ranges of scans matched in parallel by the query, each on its own thread [1 DEFAULT]" << std::endl;
+	std::cout << "-range [0..N] [0..N] matches only the scans in [first, last) [all DEFAULT]" << std::endl;
+	std::cout << "-load index file to use instead of building the index (same -t -k -b -st -alpha as when saved)" << std::endl;
+	std::cout << "-save index file to write after building the index" << std::endl;
 }
 
 //~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ 
@@ -59,6 +67,12 @@ int parse_command_line(int argc, char **argv, sw_param_str *sw_param)
 	sw_param -> kbest = 50;
 	sw_param ->  bow_subtype = 0;
 	sw_param ->  alpha_vss = 0.4;
+	sw_param ->  threads = 1;
+	sw_param ->  gfp_engine = 0;
+	sw_param ->  gfp_pruning = 0;
+	sw_param ->  shards = 1;
+	sw_param ->  range_first = -1;
+	sw_param ->  range_last = -1;
 
 	for(i=0; i<argc; i++)
 	{
@@ -91,6 +105,29 @@ int parse_command_line(int argc, char **argv, sw_param_str *sw_param)
 		if(!strcmp(argv[i], "-kbest"))		
 				sw_param -> kbest = atoi(argv[i+1]);
 
+		if(!strcmp(argv[i], "-j"))		
+				sw_param -> threads = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-gfpengine"))		
+				sw_param -> gfp_engine = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-gfpprune"))		
+				sw_param -> gfp_pruning = atof(argv[i+1]);
+
+		if(!strcmp(argv[i], "-shards"))		
+				sw_param -> shards = atoi(argv[i+1]);
+
+		if(!strcmp(argv[i], "-range"))		
+		{
+				sw_param -> range_first = atoi(argv[i+1]);
+				sw_param -> range_last = atoi(argv[i+2]);
+		}
+		if(!strcmp(argv[i], "-load"))		
+				sw_param -> indexin = argv[i+1];
+
+		if(!strcmp(argv[i], "-save"))		
+				sw_param -> indexout = argv[i+1];
+
  	}
 			
 			
@@ -151,13 +188,28 @@ int main (int argc, char **argv)
 	if(!parse_command_line(argc, argv, &sw_param))
 		exit(0);
 	
-	class gflip_engine gfp (sw_param.kernel, sw_param.kbest, sw_param.bag, sw_param.bow_subtype, sw_param.alpha_vss);
+	class gflip_engine gfp (sw_param.kernel, sw_param.kbest, sw_param.bag, sw_param.bow_subtype, sw_param.alpha_vss, sw_param.type);
 
+	gfp.set_num_threads(sw_param.threads);
 	int ret2 = gfp.read_wordscan_file(sw_param.filein);
 	std::cout << "Read FLIRT word scans: " << ret2 << std::endl;
 	 	
-	std::cout << "Preparing inverted file index and TF-IDF" << std::endl;
-	gfp.prepare( );
+	if(sw_param.indexin.size())
+	{
+		std::cout << "Loading inverted file index and TF-IDF" << std::endl;
+		if(!gfp.load_index(sw_param.indexin))
+			exit(1);
+	}
+	else
+	{
+		std::cout << "Preparing inverted file index and TF-IDF" << std::endl;
+		gfp.prepare( );
+	}
+	if(sw_param.indexout.size() && !gfp.save_index(sw_param.indexout))
+		exit(1);
+	gfp.set_gfp_engine(sw_param.gfp_engine);
+	gfp.set_gfp_pruning(sw_param.gfp_pruning);
+	gfp.set_query_shards(sw_param.shards);
 	
 	std::cout << "Example of querying a scan " << std::endl;
 	std::vector <int> query_v (26);
@@ -168,6 +220,17 @@ int main (int argc, char **argv)
 				 167, 194, 160, 130, 130,181};
 	query_v.assign(&qry[0], &qry[0]+26);
 	
+	if(sw_param.range_first >= 0)
+	{
+		std::cout << "Matching only the scans in [" << sw_param.range_first << ", " << sw_param.range_last << ")" << std::endl;
+		query_context ctx;
+		gfp.query(sw_param.type, query_v, doc_filter(sw_param.range_first, sw_param.range_last), ctx);
+		for(int ii=0;ii<std::min(sw_param.kbest, (int)ctx.results().size());ii++)
+			std::cout << "{scan id: " << ctx.results()[ii].second << " score: "<< ctx.results()[ii].first<<"}" << std::endl;
+		std::cout << "done." << std::endl; 
+		return(0);
+	}
+	
 	std::vector < std::pair <double, int> > *scorequery = NULL;
 	gfp.query(sw_param.type, query_v,  &scorequery);
 	for(int ii=0;ii<sw_param.kbest;ii++)
@@ -0,0 +1,108 @@
+//
+//
+// GFLIP - Geometrical FLIRT Phrases for Large Scale Place Recognition
+// Copyright (C) 2012-2013 Gian Diego Tipaldi and Luciano Spinello and Wolfram
+// Burgard
+//
+// This file is part of GFLIP.
+//
+// GFLIP is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GFLIP is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with GFLIP.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <gflip/gflip_engine.hpp>
+#include <iostream>
+#include <string.h>
+
+
+typedef struct
+{
+	double scale;
+	std::string filein ;
+	std::string fileout;
+}sw_param_str;
+
+//~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ 
+
+void program_info(void)
+{
+	std::cout << "-i BOW input file (text)" << std::endl;
+	std::cout << "-o binary BOW output file" << std::endl;
+	std::cout << "-fixed [meters] stores coordinates as fixed point values with this resolution [floats DEFAULT, 0.0001 if no value]" << std::endl;
+}
+
+//~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ 
+
+int parse_command_line(int argc, char **argv, sw_param_str *sw_param)
+{
+	int i;
+	
+	sw_param -> scale = 0;
+
+	for(i=0; i<argc; i++)
+	{
+		if(!strcmp(argv[i], "-i"))
+				sw_param -> filein = argv[i+1];
+
+		if(!strcmp(argv[i], "-o"))
+				sw_param -> fileout = argv[i+1];
+
+		if(!strcmp(argv[i], "-fixed"))
+		{
+			sw_param -> scale = DEFAULT_FIXEDPOINT_SCALE;
+			if(i+1 < argc && atof(argv[i+1]) > 0)
+				sw_param -> scale = atof(argv[i+1]);
+		}
+
+		if(!strcmp(argv[i], "--help"))		
+		{
+			program_info();
+			exit(1);
+		}
+ 	}
+			
+	if(!sw_param -> filein.size() || !sw_param -> fileout.size())
+	{
+		printf("Input or output filename missing\n");
+		exit(1);
+	}
+	
+	std::cout << "[PAR] BOW input filename: "  << sw_param -> filein  << std::endl;	
+	std::cout << "[PAR] Binary BOW output filename: "  << sw_param -> fileout  << std::endl;	
+	if(sw_param -> scale > 0)
+		std::cout << "[PAR] Fixed point coordinates, resolution: " << sw_param -> scale << " m" << std::endl;	
+	else
+		std::cout << "[PAR] Float coordinates" << std::endl;	
+	return(1);
+}
+
+//~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ ~ 
+
+int main (int argc, char **argv)
+{
+	sw_param_str sw_param;
+	std::cout << std::endl;
+	std::cout << ">> Converts FLIRT word scans to the binary word scan format" << std::endl  << std::endl;
+	if(!parse_command_line(argc, argv, &sw_param))
+		exit(0);
+	
+	class gflip_engine gfp (2, 1);
+
+	int ret = gfp.read_wordscan_file(sw_param.filein);
+	std::cout << "Read FLIRT word scans: " << ret << std::endl;
+	
+	if(!gfp.write_wordscan_binary(sw_param.fileout, sw_param.scale))
+		exit(1);
+	std::cout << "done." << std::endl;
+}
@@ -21,33 +21,280 @@
 //
 
 #include <gflip/gflip_engine.hpp>
+#include <thread>
+#include <atomic>
+#include <iterator>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GFLIP_X86_KERNELS
+#include <immintrin.h>
+#endif
 
+//~ binomial coefficient C(n, k), exact while it fits a long
+static constexpr long binomial_coeff(long n, int k)
+{
+	return(k <= 0 ? 1 : binomial_coeff(n, k-1) * (n-k+1) / k);
+}
+
+//~ runs fn(first, last, thread_idx) on nthreads contiguous blocks of [0,n) and waits for all of them
+template <class F> static void parallel_ranges(long n, int nthreads, F fn)
+{
+	if(nthreads <= 1)
+	{
+		fn(0, n, 0);
+		return;
+	}
+	std::vector <std::thread> workers;
+	for(int t=0;t<nthreads;t++)
+	{
+		long first = n * t / nthreads;
+		long last = n * (t+1) / nthreads;
+		workers.push_back(std::thread(fn, first, last, t));
+	}
+	for(uint t=0;t<workers.size();t++)
+		workers[t].join();
+}
+
+// ---------------------------------------------------------
+
+//~ runs fn(i, thread_idx) for every i in [0,n) on nthreads threads: each thread starts from its own contiguous block and then 
+//~ takes the items left in the blocks of the following threads. Items are claimed with fetch_add, by the owner and by the thieves alike
+template <class F> static void parallel_stealing(long n, int nthreads, F fn)
+{
+	std::vector < std::atomic <long> > next (nthreads);
+	std::vector <long> block_end (nthreads);
+	for(int t=0;t<nthreads;t++)
+	{
+		next[t] = n * t / nthreads;
+		block_end[t] = n * (t+1) / nthreads;
+	}
+	
+	parallel_ranges(nthreads, nthreads, [&](long first, long last, int t)
+	{
+		for(int v=0;v<nthreads;v++)
+		{
+			int b = (t + v) % nthreads;
+			for(long i=next[b]++; i<block_end[b]; i=next[b]++)
+				fn(i, t);
+		}
+	});
+}
 
 // ---------------------------------------------------------
 
 void gflip_engine::prepare(void)
 {	
- 	cache_binomial_coeff();
-
 	if(bow_type==1)
 		reformulate_to_bagofdistances();
 	
+	build_index();
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::refresh(void)
+{
+	if(prepared && (int)laserscan_bow.size() != postings.num_docs)
+	{
+		std::cout << "Error: refreshing needs the " << postings.num_docs << " indexed scans, " << laserscan_bow.size() << " loaded" << std::endl;
+		exit(1);
+	}
+	if(!prepared)
+		prepare();
+	else
+		build_index();
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::build_index(void)
+{
 	build_tfidf();	
+	delta_postings = std::vector <delta_posting_list> (tf_idf.size());
+	num_delta_docs = 0;
+	prepared = true;
 	
+	if(!index_has_gfp())
+		return;
 
 	//~ norms
-	normgfp_rc_idf_sum.resize(max_bow_len);
-	normgfp_rc_weak_match.resize(max_bow_len);
-	for(uint i=0;i<laserscan_bow.size();i++)
-		laserscan_bow[i].norm_wgv = norm_gfp(laserscan_bow[i].w);
+ 	cache_binomial_coeff();
+	postings.norm_wgv.resize(laserscan_bow.size());
+	int nthreads = std::min(num_threads, (int)laserscan_bow.size());
+	parallel_ranges(laserscan_bow.size(), nthreads, [&](int first, int last, int t)
+	{
+		std::vector <double> rc_idf_sum (max_bow_len);
+		std::vector <int> rc_weak_match (max_bow_len);
+		for(int i=first;i<last;i++)
+			postings.norm_wgv[i] = norm_gfp(laserscan_bow[i].w, rc_idf_sum, rc_weak_match);
+	});
+}
+
+// ---------------------------------------------------------
+
+//~ resizes v, growing the capacity geometrically so that inserting scans one by one is amortised
+template <class T> static void grow_buffer(std::vector <T> &v, size_t n)
+{
+	if(v.capacity() < n)
+		v.reserve(std::max(n, 2 * v.capacity()));
+	v.resize(n);
+}
+
+// ---------------------------------------------------------
+
+//~ sizes the GFP buffers of ctx for the current index, which may have grown since its last query
+void gflip_engine::fit_context(query_context &ctx) const
+{
+	ctx.normgfp_rc_idf_sum.resize(max_bow_len);
+	ctx.normgfp_rc_weak_match.resize(max_bow_len);
+	grow_buffer(ctx.mtchgfp_used_doc_idx, context_docs(ctx));
+	grow_buffer(ctx.mtchgfp_max_det_idx, context_docs(ctx));
+	grow_buffer(ctx.mtchgfp_min_det_idx, context_docs(ctx));
+}
+
+// ---------------------------------------------------------
+
+//~ postings of word_id for the documents matched by ctx: [first, last) in the inverted file and [delta_first, delta_last) in its delta list,
+//~ both sorted by document
+void gflip_engine::shard_postings(int word_id, const query_context &ctx, int &first, int &last, int &delta_first, int &delta_last) const
+{
+	const delta_posting_list &d = delta_postings[word_id];
+	first = postings.word_offset[word_id];
+	last = postings.word_offset[word_id+1];
+	delta_first = 0;
+	delta_last = d.doc_id.size();
+	if(ctx.doc_first == 0 && ctx.doc_last >= postings.num_docs)
+		return;
+	
+	const int *doc = postings.doc_id.data();
+	first = std::lower_bound(doc + first, doc + last, ctx.doc_first) - doc;
+	last = std::lower_bound(doc + first, doc + last, ctx.doc_last) - doc;
+	delta_first = std::lower_bound(d.doc_id.begin(), d.doc_id.end(), ctx.doc_first) - d.doc_id.begin();
+	delta_last = std::lower_bound(d.doc_id.begin() + delta_first, d.doc_id.end(), ctx.doc_last) - d.doc_id.begin();
+}
+
+// ---------------------------------------------------------
+
+//~ first posting of word_id in [a, last) whose document is >= target: the skip pointers give its block, which is then searched
+int gflip_engine::skip_postings(int word_id, int a, int last, int target) const
+{
+	const int *doc = postings.doc_id.data();
+	if(a == last || doc[a] >= target)
+		return(a);
+	int word_first = postings.word_offset[word_id], block_first = postings.block_offset[word_id];
+	const int *block_last_doc = postings.block_last_doc.data();
+	int b = block_first + (a - word_first) / POSTINGBLOCK_SIZE, b_end = block_first + (last - 1 - word_first) / POSTINGBLOCK_SIZE + 1;
+	b = std::lower_bound(block_last_doc + b, block_last_doc + b_end, target) - block_last_doc;
+	if(b == b_end)
+		return(last);
+	int from = std::max(a, word_first + (b - block_first) * POSTINGBLOCK_SIZE);
+	int to = std::min(last, word_first + (b - block_first + 1) * POSTINGBLOCK_SIZE);
+	return(std::lower_bound(doc + from, doc + to, target) - doc);
+}
+
+// ---------------------------------------------------------
+
+//~ slices of the postings [first, last) whose documents, doc[first .. last), are allowed by filter: the postings and the allowed ranges 
+//~ are walked together, skip(a, target) jumping to the first posting from a with a document >= target
+template <class S, class F> static void allowed_slices(const int *doc, int first, int last, const doc_filter &filter, S skip, F visit)
+{
+	//~ a bitmap with many ranges among few postings is tested posting by posting
+	if(first < last && filter.bits.size() && filter.num_ranges(doc[first], doc[last-1]) * FILTER_DENSE_RATIO > last - first)
+	{
+		auto allows = [&](int a) {return(doc[a] < (int)filter.bits.size() && filter.bits[doc[a]]);};
+		for(int a=first;a<last;)
+		{
+			while(a < last && !allows(a))
+				a++;
+			int b = a;
+			while(b < last && allows(b))
+				b++;
+			if(b > a)
+				visit(a, b);
+			a = b;
+		}
+		return;
+	}
+	
+	std::vector < std::pair <int, int> >::const_iterator r = filter.ranges.begin();
+	for(int a=first;a<last;)
+	{
+		//~ first range ending after the document of posting a
+		r = std::upper_bound(r, filter.ranges.end(), doc[a], [](int d, const std::pair <int, int> &x) {return(d < x.second);});
+		if(r == filter.ranges.end())
+			return;
+		a = skip(a, r->first);
+		int b = skip(a, r->second);
+		if(b > a)
+			visit(a, b);
+		a = b;
+	}
+}
+
+// ---------------------------------------------------------
 
-	//~ prepare for matching	
-	mtchgfp_rc_weak_match.resize(laserscan_bow.size() * max_bow_len);
-	mtchgfp_rc_idf_sum.resize(laserscan_bow.size() * max_bow_len);
+//~ calls visit(delta, first, last) on the slices of the postings of word_id matched by ctx, in the inverted file and then in its delta list
+template <class F> void gflip_engine::allowed_postings(int word_id, const query_context &ctx, F visit) const
+{
+	int first, last, delta_first, delta_last;
+	shard_postings(word_id, ctx, first, last, delta_first, delta_last);
+	if(!ctx.filter)
+	{
+		visit(false, first, last);
+		visit(true, delta_first, delta_last);
+		return;
+	}
 	
-	mtchgfp_used_doc_idx.resize(laserscan_bow.size());
-	mtchgfp_max_det_idx = std::vector <int> (laserscan_bow.size());
-	mtchgfp_min_det_idx = std::vector <int> (laserscan_bow.size());
+	const std::vector <int> &delta_doc = delta_postings[word_id].doc_id;
+	allowed_slices(postings.doc_id.data(), first, last, *ctx.filter, [&](int a, int target) {return(skip_postings(word_id, a, last, target));}, 
+				   [&](int a, int b) {visit(false, a, b);});
+	allowed_slices(delta_doc.data(), delta_first, delta_last, *ctx.filter, 
+				   [&](int a, int target) {return(std::lower_bound(delta_doc.begin() + a, delta_doc.begin() + delta_last, target) - delta_doc.begin());}, 
+				   [&](int a, int b) {visit(true, a, b);});
+}
+
+// ---------------------------------------------------------
+
+doc_filter::doc_filter(const std::vector <bool> &allowed)
+{
+	bits = allowed;
+	for(uint i=0;i<allowed.size();)
+	{
+		if(!allowed[i])
+		{
+			i++;
+			continue;
+		}
+		uint run_end = i;
+		while(run_end < allowed.size() && allowed[run_end])
+			run_end++;
+		ranges.push_back(std::make_pair(i, run_end));
+		i = run_end;
+	}
+}
+
+// ---------------------------------------------------------
+
+int doc_filter::next_allowed(int doc_idx) const
+{
+	std::vector < std::pair <int, int> >::const_iterator r = std::upper_bound(ranges.begin(), ranges.end(), doc_idx, 
+																			   [](int d, const std::pair <int, int> &x) {return(d < x.second);});
+	if(r == ranges.end())
+		return(INT_MAX);
+	return(std::max(doc_idx, r->first));
+}
+
+// ---------------------------------------------------------
+
+int doc_filter::num_ranges(int first, int last) const
+{
+	auto ends_before = [](int d, const std::pair <int, int> &x) {return(d < x.second);};
+	auto starts_after = [](int d, const std::pair <int, int> &x) {return(d < x.first);};
+	return(std::upper_bound(ranges.begin(), ranges.end(), last, starts_after) - std::upper_bound(ranges.begin(), ranges.end(), first, ends_before));
 }
 
  
@@ -55,6 +302,10 @@ void gflip_engine::prepare(void)
  
 void gflip_engine::cache_binomial_coeff(void)
 {
+	//~ the specialised kernels compute their binomials inline, see gfp_combo
+	cached_binomial_coeff.clear();
+	if(wgv_kernel_size >= 2 && wgv_kernel_size <= 4)
+		return;
 	cached_binomial_coeff.resize (DEFAULT_CACHEBINOMIAL,0);
 	for(uint i=wgv_kernel_size-1;i<DEFAULT_CACHEBINOMIAL;i++)
 		cached_binomial_coeff[i] = boost::math::binomial_coefficient <double>(i, (double)wgv_kernel_size-1);
@@ -63,36 +314,65 @@ void gflip_engine::cache_binomial_coeff(void)
 // ---------------------------------------------------------
 
 void gflip_engine:: reformulate_to_bagofdistances(void)
+{
+	for(uint i=0;i<laserscan_bow.size();i++)
+		reformulate_to_bagofdistances(laserscan_bow[i]);
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine:: reformulate_to_bagofdistances(scan_bow &scan)
 {
 	int sz = (bow_dst_end-bow_dst_start)/bow_dst_interval+1;
 
-	for(uint i=0;i<laserscan_bow.size();i++)
+	std::vector <int> w_tmp;
+	scan.w.clear();
+	for(int j=0;j<(int)scan.w_x.size()-1;j++)
 	{
-		std::vector <int> w_tmp;
-		laserscan_bow[i].w.clear();
-		for(int j=0;j<(int)laserscan_bow[i].w_x.size()-1;j++)
-		{
-			double dx = laserscan_bow[i].w_x[j] - laserscan_bow[i].w_x[j+1];
-			double dy = laserscan_bow[i].w_y[j] - laserscan_bow[i].w_y[j+1];
-			double d = sqrt(dx*dx + dy*dy);
-			int idx = (d-bow_dst_start)/bow_dst_interval;
-			if(idx > sz)
-				idx = sz +1;
-			w_tmp.push_back(idx);
-			laserscan_bow[i].w = w_tmp;
-			//~ std::cout << d << " " << dx << " "<< dy << " "<< idx << " " << sz << std::endl;
-		}
+		double dx = scan.w_x[j] - scan.w_x[j+1];
+		double dy = scan.w_y[j] - scan.w_y[j+1];
+		double d = sqrt(dx*dx + dy*dy);
+		int idx = (d-bow_dst_start)/bow_dst_interval;
+		if(idx > sz)
+			idx = sz +1;
+		w_tmp.push_back(idx);
+		scan.w = w_tmp;
+		//~ std::cout << d << " " << dx << " "<< dy << " "<< idx << " " << sz << std::endl;
+	}
+}
+
+// ---------------------------------------------------------
+
+//~ GFP weight of an order bin with weak_match matching words, C(weak_match-1, K-1) if weak_match >= K and 0 otherwise.
+//~ For K > 0 the polynomial is 0 for 0 < weak_match < K with no branch, and empty bins (weak_match = 0) have no idf to weigh.
+//~ K = 0 is the generic kernel, with the binomials cached for wgv_kernel_size
+template <int K> inline double gflip_engine::gfp_combo(int weak_match) const
+{
+	if(K == 0)
+		return(weak_match >= wgv_kernel_size ? cached_binomial_coeff[weak_match-1] : 0);
+	return(binomial_coeff(weak_match-1, K-1));
+}
+
+// ---------------------------------------------------------
+
+double gflip_engine::norm_gfp(const std::vector <int> & query_v, std::vector <double> &rc_idf_sum, std::vector <int> &rc_weak_match) const
+{
+	switch(wgv_kernel_size)
+	{
+		case 2: return(norm_gfp_k <2> (query_v, rc_idf_sum, rc_weak_match));
+		case 3: return(norm_gfp_k <3> (query_v, rc_idf_sum, rc_weak_match));
+		case 4: return(norm_gfp_k <4> (query_v, rc_idf_sum, rc_weak_match));
+		default: return(norm_gfp_k <0> (query_v, rc_idf_sum, rc_weak_match));
 	}
-		
 }
 
 // ---------------------------------------------------------
 
-double gflip_engine::norm_gfp(std::vector <int> & query_v)
+template <int K> double gflip_engine::norm_gfp_k(const std::vector <int> & query_v, std::vector <double> &rc_idf_sum, std::vector <int> &rc_weak_match) const
 {
 	double norm2 = 0,query_v_norm=1;
-	std::fill(normgfp_rc_idf_sum.begin(), normgfp_rc_idf_sum.end(), 0);
- 	std::fill(normgfp_rc_weak_match.begin(), normgfp_rc_weak_match.end(), 0);
+	std::fill(rc_idf_sum.begin(), rc_idf_sum.end(), 0);
+ 	std::fill(rc_weak_match.begin(), rc_weak_match.end(), 0);
 
 	int min_det_idx_qry=INT_MAX;
 	int max_det_idx_qry=-INT_MAX;
@@ -106,8 +386,8 @@ double gflip_engine::norm_gfp(std::vector <int> & query_v)
 			if(word_id == query_v[h])
 			{
 				int w_order_dif=j-h;
-				normgfp_rc_weak_match[middleidx+w_order_dif]++;
-				normgfp_rc_idf_sum[middleidx+w_order_dif] += tf_idf [word_id].idf;
+				rc_weak_match[middleidx+w_order_dif]++;
+				rc_idf_sum[middleidx+w_order_dif] += tf_idf [word_id].idf;
 				
 				if(middleidx+w_order_dif < min_det_idx_qry)
 					min_det_idx_qry = middleidx+w_order_dif;
@@ -118,12 +398,7 @@ double gflip_engine::norm_gfp(std::vector <int> & query_v)
 	}
 
 	for(int b=min_det_idx_qry;b<=max_det_idx_qry;b++)
-	{
-		double combo = 0;
-		if(normgfp_rc_weak_match[b] >= wgv_kernel_size )
-			combo = cached_binomial_coeff[normgfp_rc_weak_match[b]-1];
-		norm2 +=normgfp_rc_idf_sum[b] * combo;
-	}
+		norm2 +=rc_idf_sum[b] * gfp_combo <K> (rc_weak_match[b]);
 	//~ rounding errs
 	if(norm2 > 0)
 		query_v_norm = sqrt(norm2); 
@@ -135,390 +410,2031 @@ double gflip_engine::norm_gfp(std::vector <int> & query_v)
  
 // ---------------------------------------------------------
 
-void gflip_engine::matching_gfp(std::vector <int> &query_v)
+void gflip_engine::matching_gfp(const std::vector <int> &query_v, query_context &ctx) const
 {
-	int middleidx = max_bow_len/2;
-	std::fill(mtchgfp_used_doc_idx.begin(), mtchgfp_used_doc_idx.end(), 0);
-	std::fill(mtchgfp_min_det_idx.begin(), mtchgfp_min_det_idx.end(), +INT_MAX);
-	std::fill(mtchgfp_max_det_idx.begin(), mtchgfp_max_det_idx.end(), -INT_MAX);
- 
- 	std::fill(mtchgfp_rc_weak_match.begin(), mtchgfp_rc_weak_match.end(), 0);
- 	std::fill(mtchgfp_rc_idf_sum.begin(), mtchgfp_rc_idf_sum.end(), 0);
-
-	//~ query norm
-	double query_v_norm = norm_gfp(query_v);
- 	//~ every word of the query
-	for(uint j=0;j<query_v.size();j++)
+	fit_context(ctx);
+	switch(wgv_kernel_size)
 	{
-		int word_id = query_v[j];
-		for(uint a=0;a<tf_idf[word_id].doc_id.size();a++)
-		{
-			int doc_idx = tf_idf[word_id].doc_id[a];
-			mtchgfp_used_doc_idx[doc_idx] = 1;
-
-			//~ match positions
-			for(uint h=0;h<tf_idf[word_id].word_order[a].pos.size();h++)
-			{
-				int w_order_dif=j-tf_idf[word_id].word_order[a].pos[h];
-				int rcidx = (max_bow_len * doc_idx) + (middleidx+w_order_dif);
-							
-				mtchgfp_rc_weak_match[rcidx]++;
-				mtchgfp_rc_idf_sum[rcidx] += tf_idf [word_id].idf;
-				
-				if(middleidx+w_order_dif < mtchgfp_min_det_idx[doc_idx])
-					mtchgfp_min_det_idx[doc_idx] = middleidx+w_order_dif;
-				if(middleidx+w_order_dif > mtchgfp_max_det_idx[doc_idx])
-					mtchgfp_max_det_idx[doc_idx] = middleidx+w_order_dif;								
-			}
-		}
+		case 2: matching_gfp_k <2> (query_v, ctx); break;
+		case 3: matching_gfp_k <3> (query_v, ctx); break;
+		case 4: matching_gfp_k <4> (query_v, ctx); break;
+		default: matching_gfp_k <0> (query_v, ctx); break;
 	}
+}
 
-	int num_used_doc_idx = 0;
-	for(uint j=0;j<mtchgfp_used_doc_idx.size();j++)
-		if(mtchgfp_used_doc_idx[j] == 1)
-			num_used_doc_idx++;
-	scoreset.resize(num_used_doc_idx);
-	for(uint j=0, u_idx=0;j<mtchgfp_used_doc_idx.size();j++)
-	{
-		if(mtchgfp_used_doc_idx[j] == 0)
-			continue;
+// ---------------------------------------------------------
 
-		//~ default values
-		int doc_idx = j;
-		double score = 0;
-		scoreset[u_idx].first = 1.0;
-		scoreset[u_idx].second = doc_idx;
-		
-		//~ compute score
-		for(int b=mtchgfp_min_det_idx[doc_idx];b<=mtchgfp_max_det_idx[doc_idx];b++)
-		{
-			double combo = 0;
-			int rcidx = (max_bow_len * doc_idx) + b;
-			 
-			if(mtchgfp_rc_weak_match[rcidx] >= wgv_kernel_size )
-				combo = cached_binomial_coeff[ mtchgfp_rc_weak_match[rcidx]-1 ];
-			score +=mtchgfp_rc_idf_sum[rcidx] * combo;
-		}		
-		//~ normed istance
-		score = score / (laserscan_bow[doc_idx].norm_wgv * query_v_norm);
- 		
-		//~ avoids no go zone
-		if( doc_idx <= start_l || doc_idx >= stop_l)
-			scoreset[u_idx].first = 1.0 - score;
-		
-		u_idx++;	
-  	}
-	
-	//~ sort the results
- 	sort(scoreset.begin(), scoreset.end(), isBettermatched);
-	 
+template <int K> void gflip_engine::matching_gfp_k(const std::vector <int> &query_v, query_context &ctx) const
+{
+	if(gfp_engine == 1)
+		matching_gfp_hits <K> (query_v, ctx);
+	else
+		matching_gfp_dense <K> (query_v, ctx);
 }
 
 // ---------------------------------------------------------
 
-bool isBettermatched(std::pair <double, int> x, std::pair <double, int> y) 
+//~ stable LSD radix sort of the hits by key, one pass per byte up to the highest byte of max_key
+static void radix_sort_hits(std::vector <gfp_hit> &hits, std::vector <gfp_hit> &tmp, uint64_t max_key)
 {
-    return x.first < y.first;
+	tmp.resize(hits.size());
+	for(int shift=0; shift<64 && (max_key >> shift); shift+=8)
+	{
+		size_t count[257] = {0};
+		for(size_t i=0;i<hits.size();i++)
+			count[((hits[i].key >> shift) & 255) + 1]++;
+		
+		//~ all the hits in one bucket, nothing to move
+		if(*std::max_element(count+1, count+257) == hits.size())
+			continue;
+		for(int b=0;b<256;b++)
+			count[b+1] += count[b];
+		for(size_t i=0;i<hits.size();i++)
+			tmp[count[(hits[i].key >> shift) & 255]++] = hits[i];
+		hits.swap(tmp);
+	}
 }
 
 // ---------------------------------------------------------
 
-void gflip_engine::matching_bow(std::vector <int> &query_v )
+template <int K> void gflip_engine::matching_gfp_hits(const std::vector <int> &query_v, query_context &ctx) const
 {
-	std::vector <double> image_db_scores(laserscan_bow.size(),0);
-	std::set<int> used_doc_idx;
+	int middleidx = max_bow_len/2;
+	double query_v_norm = norm_gfp_k <K> (query_v, ctx.normgfp_rc_idf_sum, ctx.normgfp_rc_weak_match);
 	
-	double query_v_norm = 1, qsum = 0;
-	std::vector <double> query_bow = std::vector <double> (dictionary_dimensions,0);
-	for(uint j=0;j<query_v.size();j++)
-		query_bow[query_v[j]]++;
-
-	for(uint j=0;j<query_bow.size();j++)
-		qsum+=query_bow[j]*query_bow[j];
-	if(qsum != 0)
-		query_v_norm = sqrt(qsum);
-
-	//~ query tdidf voting
+	//~ one hit per matching word order, emitted in the traversal order of matching_gfp_dense
+	ctx.mtchgfp_hits.clear();
+	auto emit_hits = [&](int j, double idf, int doc_idx, const int *pos, const int *pos_end)
+	{
+		uint64_t row = (uint64_t)max_bow_len * doc_idx + middleidx + j;
+		for(;pos<pos_end;pos++)
+		{
+			gfp_hit hit;
+			hit.key = row - *pos;
+			hit.idf = idf;
+			ctx.mtchgfp_hits.push_back(hit);
+		}
+	};
 	for(uint j=0;j<query_v.size();j++)
 	{
 		int word_id = query_v[j];
-		for(uint a=0;a<tf_idf[word_id].doc_id.size();a++)
+		double idf = tf_idf[word_id].idf;
+		const delta_posting_list &d = delta_postings[word_id];
+		allowed_postings(word_id, ctx, [&](bool delta, int first, int last)
 		{
-			int img_idx = tf_idf[word_id].doc_id[a];
+			if(!delta)
+				for(int a=first;a<last;a++)
+					emit_hits(j, idf, postings.doc_id[a], postings.pos.data() + postings.pos_offset[a], postings.pos.data() + postings.pos_offset[a+1]);
 			
-			if(bow_subtype == 0)
-				image_db_scores[img_idx] += tf_idf[word_id].tf_idf_doc_normed[a];
-			if(bow_subtype == 1)
-				image_db_scores[img_idx] += tf_idf[word_id].wf_idf_doc_normed[a];
-			if(bow_subtype == 2)
-				image_db_scores[img_idx] += tf_idf[word_id].ntf_idf_doc_normed[a];
-
-			used_doc_idx.insert(img_idx);
-		}
+			//~ scans inserted after the last build
+			else
+				for(int a=first;a<last;a++)
+					emit_hits(j, idf, d.doc_id[a], d.pos.data() + d.pos_offset[a], d.pos.data() + d.pos_offset[a+1]);
+		});
 	}
-
-	scoreset.resize(used_doc_idx.size());
-	int u_idx=0;
-	for (std::set<int>::iterator it=used_doc_idx.begin(); it!=used_doc_idx.end(); it++)
+	
+	//~ the sort is stable, so every bin sums its idf in the same order as the dense engine
+	radix_sort_hits(ctx.mtchgfp_hits, ctx.mtchgfp_hits_tmp, (uint64_t)max_bow_len * postings.num_docs);
+	
+	//~ reduce: runs of equal keys are bins, runs of equal key / max_bow_len are documents
+	ctx.scoreset.clear();
+	for(size_t i=0;i<ctx.mtchgfp_hits.size();)
 	{
-		double score = image_db_scores[*it]/query_v_norm;
+		int doc_idx = ctx.mtchgfp_hits[i].key / max_bow_len;
+		uint64_t doc_end = (uint64_t)max_bow_len * (doc_idx + 1);
+		double score = 0;
+		while(i < ctx.mtchgfp_hits.size() && ctx.mtchgfp_hits[i].key < doc_end)
+		{
+			uint64_t key = ctx.mtchgfp_hits[i].key;
+			int weak_match = 0;
+			double idf_sum = 0;
+			for(;i < ctx.mtchgfp_hits.size() && ctx.mtchgfp_hits[i].key == key;i++)
+			{
+				weak_match++;
+				idf_sum += ctx.mtchgfp_hits[i].idf;
+			}
+			score += idf_sum * gfp_combo <K> (weak_match);
+		}
 		
-		scoreset[u_idx].first = 1.0;
-		scoreset[u_idx].second = *it;
-
-		//~ avoids no-go zone
-		if( *it <= start_l || *it >= stop_l)
-			scoreset[u_idx].first = 1.0 - score;
-		u_idx++;
-	}
- 
-
-	sort(scoreset.begin(), scoreset.end(), isBettermatched);
- 	 
- }
-
-
-// ---------------------------------------------------------
-
- 
-void gflip_engine::query(int dtype, std::vector <int> &query_v, std::vector < std::pair <double, int> > **scoreoutput)
-{
-	//~ avoids any skip 
-	start_l = 0; 
-	stop_l = 0;
-	//~ does the search
-	if(dtype ==1)
-		matching_bow(query_v);
-	if(dtype ==2)
-		matching_gfp(query_v);
+		//~ normed istance
+		score = score / (postings.norm_wgv[doc_idx] * query_v_norm);
 		
-	*scoreoutput = &scoreset;	
+		//~ avoids no go zone
+		ctx.scoreset.push_back(std::make_pair(1.0, doc_idx));
+		if( doc_idx <= ctx.start_l || doc_idx >= ctx.stop_l)
+			ctx.scoreset.back().first = 1.0 - score;
+	}
+	
+	//~ rank the results
+	rank_scores(ctx);
 }
 
 // ---------------------------------------------------------
 
-
-
-void gflip_engine::run_evaluation(int dtype)
+template <int K> void gflip_engine::matching_gfp_dense(const std::vector <int> &query_v, query_context &ctx) const
 {
-	struct timeval tim_st,tim_ed;  
-	char nosave = 0;
-
-	char buff[2000];
-	sprintf(buff,"./%s.nn", fileoutput_rootname.c_str());
-	FILE *f;
+	int middleidx = max_bow_len/2;
+	int n = query_v.size();
 	
-	if(!nosave)
-		f=fopen(buff, "wt");
-		
-	double dtime_avg=0;
-	int countv=0;
-	for(uint i=0;i<number_of_scans;i++)
+	//~ the rows are only allocated by the dense engine
+	if(ctx.mtchgfp_rc_weak_match.size() < (size_t)context_docs(ctx) * max_bow_len)
 	{
-		//~ match this query,just the seq found
-		std::vector <int> query_v  = laserscan_bow[i].w;
+		grow_buffer(ctx.mtchgfp_rc_weak_match, (size_t)context_docs(ctx) * max_bow_len);
+		grow_buffer(ctx.mtchgfp_rc_idf_sum, (size_t)context_docs(ctx) * max_bow_len);
+	}
+	
+	//~ the accumulators are all zero between queries: only the documents in mtchgfp_touched_docs are 
+	//~ initialised when first hit, and only their [min_det_idx, max_det_idx] cells are cleared after scoring
+	ctx.mtchgfp_touched_docs.clear();
+	ctx.num_postings = 0;
+	ctx.num_skipped_postings = 0;
 
-		//~ if 0 len
-		if(!query_v.size())
+	//~ query norm
+	double query_v_norm = norm_gfp_k <K> (query_v, ctx.normgfp_rc_idf_sum, ctx.normgfp_rc_weak_match);
+	
+	//~ document states in mtchgfp_used_doc_idx: 0 not reached, 1 accumulated; with pruning also 2 reached only by non essential words, 
+	//~ 3 reached by an essential word, 4 reached only by non essential words with a score bound over the threshold, 5 accumulated after being 4
+	bool pruning = gfp_pruning > 0 && !full_ranking && kbest > 0 && n > 1;
+	
+	//~ one posting: the word orders [pos, pos_end) of query word j in doc_idx, accumulated in the rows of the document
+	auto match_positions = [&](int j, double idf, int doc_idx, char state, const int *pos, const int *pos_end)
+	{
+		int row = doc_idx - ctx.doc_first;
+		if(ctx.mtchgfp_used_doc_idx[row] != state)
 		{
-			if(!nosave)
-				fprintf (f, "\n");
-			continue;
+			ctx.mtchgfp_used_doc_idx[row] = state;
+			ctx.mtchgfp_min_det_idx[row] = +INT_MAX;
+			ctx.mtchgfp_max_det_idx[row] = -INT_MAX;
+			ctx.mtchgfp_touched_docs.push_back(doc_idx);
 		}
-		//~ exclude the i scan
-		start_l = i-1; 
-		stop_l = i+1;
-
-		//~ match with several techs
-    	gettimeofday(&tim_st, NULL);  
-		if(dtype ==1)
-			matching_bow(query_v);
-		if(dtype ==2)
-			matching_gfp(query_v);
-		gettimeofday(&tim_ed, NULL);  
-		double dtimeqry = (tim_ed.tv_sec-tim_st.tv_sec) + (tim_ed.tv_usec-tim_st.tv_usec)/1000000.0;
-		dtime_avg += dtimeqry;
-		if(!nosave)
+		for(;pos<pos_end;pos++)
 		{
-			fprintf (f, "%d %d %7.7f ", kbest, (int)scoreset.size(), dtimeqry);
-			uint minscoresetsize = std::min((int)kbest,(int)scoreset.size());
-			for(uint ii=0;ii<minscoresetsize;ii++)
-				fprintf (f, "%d ", scoreset[ii].second);
-			fprintf (f, "\n");
+			int w_order_dif=j-*pos;
+			int rcidx = (max_bow_len * row) + (middleidx+w_order_dif);
+						
+			ctx.mtchgfp_rc_weak_match[rcidx]++;
+			ctx.mtchgfp_rc_idf_sum[rcidx] += idf;
+			
+			if(middleidx+w_order_dif < ctx.mtchgfp_min_det_idx[row])
+				ctx.mtchgfp_min_det_idx[row] = middleidx+w_order_dif;
+			if(middleidx+w_order_dif > ctx.mtchgfp_max_det_idx[row])
+				ctx.mtchgfp_max_det_idx[row] = middleidx+w_order_dif;								
 		}
-		countv++;
-	}
-	std::cout << "Averge query time: "<< (double)dtime_avg/(double)countv << " total  time: " << dtime_avg << " # scans: " << countv << std::endl;
-	if(!nosave)
-		fclose(f);
-}
-
- 
- 
-
-// ---------------------------------------------------------
-
-
-void gflip_engine::build_tfidf(void)
-{
-	//~ find id size, maxlen
-	int maxid= -1;
-	int maxid_idx = -1;
-	max_bow_len = -INT_MAX;
-
-	for(uint i=0;i<laserscan_bow.size();i++)
+	};
+	
+	//~ first pass: all the documents without pruning, otherwise the ones reached by an essential word. The others are deferred, 
+	//~ keeping the number of query words reaching them and the idf mass of their hits
+	auto first_pass = [&](int j, double idf, int doc_idx, const int *pos, const int *pos_end)
 	{
-		for(uint j=0;j<laserscan_bow[i].w.size();j++)
+		int row = doc_idx - ctx.doc_first;
+		char state = ctx.mtchgfp_used_doc_idx[row];
+		if(!pruning || state == 1 || state == 3)
 		{
-			if(laserscan_bow[i].w[j] > maxid)
-			{
-				maxid = laserscan_bow[i].w[j];
-				maxid_idx = i;
-			}
-		
+			match_positions(j, idf, doc_idx, 1, pos, pos_end);
+			return;
 		}
-			
-		if((int)laserscan_bow[i].w.size() > max_bow_len)
-			max_bow_len=laserscan_bow[i].w.size();			
+		if(state == 0)
+		{
+			ctx.mtchgfp_used_doc_idx[row] = 2;
+			ctx.mtchgfp_skipped_docs.push_back(doc_idx);
+			ctx.mtchgfp_num_words[row] = 0;
+			ctx.mtchgfp_idf_mass[row] = 0;
+		}
+		ctx.mtchgfp_num_words[row]++;
+		ctx.mtchgfp_idf_mass[row] += idf * (pos_end - pos);
+		ctx.num_skipped_postings++;
+	};
+	
+	//~ second pass: the deferred documents whose bound reaches the threshold
+	auto second_pass = [&](int j, double idf, int doc_idx, const int *pos, const int *pos_end)
+	{
+		char state = ctx.mtchgfp_used_doc_idx[doc_idx - ctx.doc_first];
+		if(state == 4 || state == 5)
+		{
+			match_positions(j, idf, doc_idx, 5, pos, pos_end);
+			ctx.num_skipped_postings--;
+		}
+	};
+	
+	//~ all the postings of query word j
+	auto match_word = [&](int j, bool second)
+	{
+		int word_id = query_v[j];
+		double idf = tf_idf[word_id].idf;
+		const delta_posting_list &d = delta_postings[word_id];
+		allowed_postings(word_id, ctx, [&](bool delta, int first, int last)
+		{
+			const int *doc = delta ? d.doc_id.data() : postings.doc_id.data();
+			const int *pos = delta ? d.pos.data() : postings.pos.data();
+			const int *pos_offset = delta ? d.pos_offset.data() : postings.pos_offset.data();
+			if(!second)
+			{
+				for(int a=first;a<last;a++)
+					first_pass(j, idf, doc[a], pos + pos_offset[a], pos + pos_offset[a+1]);
+				ctx.num_postings += last - first;
+				return;
+			}
+			for(int a=first;a<last;a++)
+				second_pass(j, idf, doc[a], pos + pos_offset[a], pos + pos_offset[a+1]);
+		});
+	};
+	
+	//~ scores the touched documents from index position t on, clearing their cells
+	auto score_touched = [&](uint t)
+	{
+		//~ documents in index order, as the sort below is not stable
+		std::sort(ctx.mtchgfp_touched_docs.begin() + t, ctx.mtchgfp_touched_docs.end());
+		for(;t<ctx.mtchgfp_touched_docs.size();t++)
+		{
+			//~ default values
+			int doc_idx = ctx.mtchgfp_touched_docs[t];
+			int row = doc_idx - ctx.doc_first;
+			double score = 0;
+			ctx.scoreset.push_back(std::make_pair(1.0, doc_idx));
+			
+			//~ compute score
+			for(int b=ctx.mtchgfp_min_det_idx[row];b<=ctx.mtchgfp_max_det_idx[row];b++)
+			{
+				int rcidx = (max_bow_len * row) + b;
+				score +=ctx.mtchgfp_rc_idf_sum[rcidx] * gfp_combo <K> (ctx.mtchgfp_rc_weak_match[rcidx]);
+				
+				ctx.mtchgfp_rc_weak_match[rcidx] = 0;
+				ctx.mtchgfp_rc_idf_sum[rcidx] = 0;
+			}		
+			ctx.mtchgfp_used_doc_idx[row] = 0;
+			//~ normed istance
+			score = score / (postings.norm_wgv[doc_idx] * query_v_norm);
+	 		
+			//~ avoids no go zone
+			if( doc_idx <= ctx.start_l || doc_idx >= ctx.stop_l)
+				ctx.scoreset.back().first = 1.0 - score;
+		}
+	};
+	
+	if(pruning)
+	{
+		grow_buffer(ctx.mtchgfp_num_words, context_docs(ctx));
+		grow_buffer(ctx.mtchgfp_idf_mass, context_docs(ctx));
+		ctx.mtchgfp_skipped_docs.clear();
+		
+		//~ the query words with the highest idf are essential, their documents are marked
+		ctx.mtchgfp_order.resize(n);
+		for(int j=0;j<n;j++)
+			ctx.mtchgfp_order[j] = j;
+		std::stable_sort(ctx.mtchgfp_order.begin(), ctx.mtchgfp_order.end(), [&](int a, int b) {return(tf_idf[query_v[a]].idf > tf_idf[query_v[b]].idf);});
+		int num_essential = std::min(n, std::max(1, (int)ceil(gfp_pruning * n)));
+		for(int e=0;e<num_essential;e++)
+		{
+			int word_id = query_v[ctx.mtchgfp_order[e]];
+			allowed_postings(word_id, ctx, [&](bool delta, int first, int last)
+			{
+				const int *doc = delta ? delta_postings[word_id].doc_id.data() : postings.doc_id.data();
+				for(int a=first;a<last;a++)
+					ctx.mtchgfp_used_doc_idx[doc[a] - ctx.doc_first] = 3;
+			});
+		}
+	}
+	
+ 	//~ every word of the query
+	for(int j=0;j<n;j++)
+		match_word(j, false);
+	ctx.scoreset.clear();
+	score_touched(0);
+	
+	if(pruning && ctx.mtchgfp_skipped_docs.size())
+	{
+		//~ the kbest-th best score of the accumulated documents is a lower bound of the kbest-th best score
+		double threshold = 0;
+		ctx.mtchgfp_partial_score.clear();
+		for(uint t=0;t<ctx.scoreset.size();t++)
+			if(ctx.scoreset[t].first < 1.0 || ( ctx.scoreset[t].second <= ctx.start_l || ctx.scoreset[t].second >= ctx.stop_l))
+				ctx.mtchgfp_partial_score.push_back(1.0 - ctx.scoreset[t].first);
+		if(ctx.mtchgfp_partial_score.size() >= kbest)
+		{
+			std::nth_element(ctx.mtchgfp_partial_score.begin(), ctx.mtchgfp_partial_score.begin() + (kbest - 1), ctx.mtchgfp_partial_score.end(), std::greater <double> ());
+			threshold = ctx.mtchgfp_partial_score[kbest - 1] * (1 - GFPPRUNING_SLACK);
+		}
+		
+		//~ a deferred document gets at most one hit per order bin from each of the num_words query words reaching it, 
+		//~ so its unnormed score is at most the idf mass of its hits times the weight of a bin matching all of them
+		bool revived = false;
+		for(uint t=0;t<ctx.mtchgfp_skipped_docs.size();t++)
+		{
+			int doc_idx = ctx.mtchgfp_skipped_docs[t];
+			int row = doc_idx - ctx.doc_first;
+			double bound = ctx.mtchgfp_idf_mass[row] * gfp_combo <K> (ctx.mtchgfp_num_words[row]) * (1 + GFPPRUNING_SLACK);
+			if(bound >= threshold * postings.norm_wgv[doc_idx] * query_v_norm)
+			{
+				ctx.mtchgfp_used_doc_idx[row] = 4;
+				revived = true;
+			}
+		}
+		if(revived)
+		{
+			uint t = ctx.mtchgfp_touched_docs.size();
+			for(int j=0;j<n;j++)
+				match_word(j, true);
+			score_touched(t);
+		}
+		for(uint t=0;t<ctx.mtchgfp_skipped_docs.size();t++)
+			ctx.mtchgfp_used_doc_idx[ctx.mtchgfp_skipped_docs[t] - ctx.doc_first] = 0;
+	}
+	
+	//~ rank the results
+	rank_scores(ctx);
+	 
+}
+
+// ---------------------------------------------------------
+
+bool isBettermatched(std::pair <double, int> x, std::pair <double, int> y) 
+{
+    return x.first < y.first;
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::rank_scores(query_context &ctx) const
+{
+	std::vector < std::pair <double, int> > &scoreset = ctx.scoreset;
+	
+	//~ selects the kbest results in linear time and sorts only them
+	if(!full_ranking && kbest > 0 && kbest < scoreset.size())
+	{
+		std::nth_element(scoreset.begin(), scoreset.begin() + (kbest - 1), scoreset.end(), isBettermatched);
+		sort(scoreset.begin(), scoreset.begin() + kbest, isBettermatched);
+		return;
+	}
+	sort(scoreset.begin(), scoreset.end(), isBettermatched);
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::set_num_threads(int nt)
+{
+	num_threads = nt;
+	if(num_threads <= 0)
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+// ---------------------------------------------------------
+
+long posting_index::memory_bytes(void) const
+{
+	long ints = word_offset.size() + pos_offset.size() + doc_id.size() + term_count_unnormalized.size() + pos.size() + word_shift.size() + block_offset.size() + block_last_doc.size();
+	long doubles = tf_idf_doc_normed.size() + ntf_idf_doc_normed.size() + wf_idf_doc_normed.size() + norm_wgv.size() + block_max_wgt.size() + word_max_wgt.size();
+	return(ints * sizeof(int) + doubles * sizeof(double) + wgt_q8.size() * sizeof(uint8_t) + wgt_q16.size() * sizeof(uint16_t));
+}
+
+// ---------------------------------------------------------
+
+double elapsed_since(const struct timeval &tim_st)
+{
+	struct timeval tim_ed;
+	gettimeofday(&tim_ed, NULL);
+	return( (tim_ed.tv_sec-tim_st.tv_sec) + (tim_ed.tv_usec-tim_st.tv_usec)/1000000.0 );
+}
+
+// ---------------------------------------------------------
+
+long peak_memory_kb(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return(usage.ru_maxrss);
+}
+
+// ---------------------------------------------------------
+
+//~ BoW kernels: add the weights wgt[0..n) of the postings of one word to the scores of their documents doc[0..n), listing the documents 
+//~ touched for the first time in touched[num_touched..], which has room for all the documents plus one. The documents of a word are distinct, 
+//~ so the vector variants can gather and store the scores of several postings at once; every score gets the same additions in the 
+//~ same order in all the variants
+typedef void (*bow_kernel_fn)(const int *doc, const double *wgt, int n, int doc_first, double *scores, char *used, int *touched, int &num_touched);
+
+//~ without branches: the document is always written and kept only if it was not used
+static inline void bow_touch(int doc, int row, char *used, int *touched, int &num_touched)
+{
+	touched[num_touched] = doc;
+	num_touched += !used[row];
+	used[row] = 1;
+}
+
+static void bow_accumulate_scalar(const int *doc, const double *wgt, int n, int doc_first, double *scores, char *used, int *touched, int &num_touched)
+{
+	for(int a=0;a<n;a++)
+	{
+		int row = doc[a] - doc_first;
+		scores[row] += wgt[a];
+		bow_touch(doc[a], row, used, touched, num_touched);
+	}
+}
+
+#ifdef GFLIP_X86_KERNELS
+__attribute__((target("sse4.1"))) static void bow_accumulate_sse4(const int *doc, const double *wgt, int n, int doc_first, double *scores, char *used, int *touched, int &num_touched)
+{
+	int a = 0;
+	for(;a+2<=n;a+=2)
+	{
+		int row0 = doc[a] - doc_first, row1 = doc[a+1] - doc_first;
+		__m128d sum = _mm_loadh_pd(_mm_load_sd(scores + row0), scores + row1);
+		sum = _mm_add_pd(sum, _mm_loadu_pd(wgt + a));
+		_mm_storel_pd(scores + row0, sum);
+		_mm_storeh_pd(scores + row1, sum);
+		bow_touch(doc[a], row0, used, touched, num_touched);
+		bow_touch(doc[a+1], row1, used, touched, num_touched);
+	}
+	bow_accumulate_scalar(doc + a, wgt + a, n - a, doc_first, scores, used, touched, num_touched);
+}
+
+// ---------------------------------------------------------
+
+__attribute__((target("avx2"))) static void bow_accumulate_avx2(const int *doc, const double *wgt, int n, int doc_first, double *scores, char *used, int *touched, int &num_touched)
+{
+	__m128i first = _mm_set1_epi32(doc_first);
+	__m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	alignas(32) double sum[4];
+	alignas(16) int row[4];
+	int a = 0;
+	for(;a+4<=n;a+=4)
+	{
+		__m128i rows = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(doc + a)), first);
+		__m256d s = _mm256_add_pd(_mm256_mask_i32gather_pd(_mm256_setzero_pd(), scores, rows, all, 8), _mm256_loadu_pd(wgt + a));
+		
+		//~ AVX2 has no scatter
+		_mm256_store_pd(sum, s);
+		_mm_store_si128((__m128i *)row, rows);
+		for(int b=0;b<4;b++)
+		{
+			scores[row[b]] = sum[b];
+			bow_touch(doc[a+b], row[b], used, touched, num_touched);
+		}
+	}
+	bow_accumulate_scalar(doc + a, wgt + a, n - a, doc_first, scores, used, touched, num_touched);
+}
+#endif
+
+// ---------------------------------------------------------
+
+//~ quantised weights of a word, whose scale is 2^-shift of the common one
+template <class T> static void bow_accumulate_quantised(const int *doc, const T *q, int n, int shift, int doc_first, int64_t *scores, char *used, int *touched, int &num_touched)
+{
+	for(int a=0;a<n;a++)
+	{
+		int row = doc[a] - doc_first;
+		scores[row] += (int64_t)q[a] << shift;
+		bow_touch(doc[a], row, used, touched, num_touched);
+	}
+}
+
+// ---------------------------------------------------------
+
+int gflip_engine::get_bow_kernel(void) const
+{
+	int k = bow_kernel;
+#ifdef GFLIP_X86_KERNELS
+	static const bool has_sse4 = __builtin_cpu_supports("sse4.1"), has_avx2 = __builtin_cpu_supports("avx2");
+	//~ the SSE4.1 kernel is no faster than the scalar one, it runs only when selected
+	if(k == 0)
+		k = has_avx2 ? 3 : 1;
+	if(k == 3 && !has_avx2)
+		k = 2;
+	if(k == 2 && !has_sse4)
+		k = 1;
+#else
+	k = 1;
+#endif
+	return(k);
+}
+
+// ---------------------------------------------------------
+
+//~ weights of TF-IDF flavour F, in the inverted file or in a delta list
+template <int F, class P> static inline auto bow_weights(const P &p) -> const decltype(p.tf_idf_doc_normed) &
+{
+	return(F == 0 ? p.tf_idf_doc_normed : F == 1 ? p.wf_idf_doc_normed : p.ntf_idf_doc_normed);
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::matching_bow(const std::vector <int> &query_v, query_context &ctx) const
+{
+	ctx.num_blocks = 0;
+	ctx.num_skipped_blocks = 0;
+	if(bow_block_max && !full_ranking && kbest > 0 && !postings.word_max_wgt.empty())
+	{
+		switch(bow_subtype)
+		{
+			case 1: matching_bow_wand <1> (query_v, ctx); break;
+			case 2: matching_bow_wand <2> (query_v, ctx); break;
+			default: matching_bow_wand <0> (query_v, ctx); break;
+		}
+		return;
+	}
+	switch(bow_subtype)
+	{
+		case 1: matching_bow_f <1> (query_v, ctx); break;
+		case 2: matching_bow_f <2> (query_v, ctx); break;
+		default: matching_bow_f <0> (query_v, ctx); break;
+	}
+}
+
+// ---------------------------------------------------------
+
+template <int F> void gflip_engine::matching_bow_f(const std::vector <int> &query_v, query_context &ctx) const
+{
+	//~ the scores are all zero between queries, only the touched documents are cleared after ranking
+	grow_buffer(ctx.mtchbow_scores, context_docs(ctx));
+	grow_buffer(ctx.mtchbow_used_doc_idx, context_docs(ctx));
+	grow_buffer(ctx.mtchbow_touched_docs, context_docs(ctx) + 1);
+	int num_touched = 0;
+	
+	//~ query norm from the counts of its distinct words
+	double query_v_norm = 1, qsum = 0;
+	ctx.mtchbow_query_words.assign(query_v.begin(), query_v.end());
+	std::sort(ctx.mtchbow_query_words.begin(), ctx.mtchbow_query_words.end());
+	for(uint j=0;j<ctx.mtchbow_query_words.size();)
+	{
+		uint j_end = j;
+		while(j_end < ctx.mtchbow_query_words.size() && ctx.mtchbow_query_words[j_end] == ctx.mtchbow_query_words[j])
+			j_end++;
+		qsum += (double)(j_end - j) * (j_end - j);
+		j = j_end;
+	}
+	if(qsum != 0)
+		query_v_norm = sqrt(qsum);
+
+	double *image_db_scores = ctx.mtchbow_scores.data();
+	char *used_doc_idx = ctx.mtchbow_used_doc_idx.data();
+	
+	//~ weights of the TF-IDF flavour
+	bow_kernel_fn accumulate = bow_accumulate_scalar;
+#ifdef GFLIP_X86_KERNELS
+	int k = get_bow_kernel();
+	if(k == 2)
+		accumulate = bow_accumulate_sse4;
+	if(k == 3)
+		accumulate = bow_accumulate_avx2;
+#endif
+	const double *wgt = bow_weights <F> (postings).data();
+	ctx.num_postings = 0;
+	
+	//~ quantised weights: integer scores in units of 2^-BOWQUANT_MAXSHIFT / qmax
+	int bits = postings.quantisation_bits;
+	double qmax = (1 << bits) - 1, unit = bits ? ldexp(1.0 / qmax, -BOWQUANT_MAXSHIFT) : 0;
+	if(bits)
+		grow_buffer(ctx.mtchbow_int_scores, context_docs(ctx));
+	int64_t *int_scores = ctx.mtchbow_int_scores.data();
+	
+	//~ query tdidf voting
+	for(uint j=0;j<query_v.size();j++)
+	{
+		int word_id = query_v[j];
+		const delta_posting_list &d = delta_postings[word_id];
+		const std::vector <double> &delta_wgt = bow_weights <F> (d);
+		allowed_postings(word_id, ctx, [&](bool delta, int first, int last)
+		{
+			ctx.num_postings += last - first;
+			if(!bits)
+			{
+				if(!delta)
+					accumulate(postings.doc_id.data() + first, wgt + first, last - first, ctx.doc_first, image_db_scores, used_doc_idx, ctx.mtchbow_touched_docs.data(), num_touched);
+				
+				//~ scans inserted after the last build
+				else
+					accumulate(d.doc_id.data() + first, delta_wgt.data() + first, last - first, ctx.doc_first, image_db_scores, used_doc_idx, ctx.mtchbow_touched_docs.data(), num_touched);
+				return;
+			}
+			
+			//~ words new since the last build have no scale, nor postings in the inverted file
+			if(!delta && first < last)
+			{
+				int shift = BOWQUANT_MAXSHIFT - postings.word_shift[word_id];
+				if(bits == 8)
+					bow_accumulate_quantised(postings.doc_id.data() + first, postings.wgt_q8.data() + first, last - first, shift, ctx.doc_first, int_scores, used_doc_idx, ctx.mtchbow_touched_docs.data(), num_touched);
+				else
+					bow_accumulate_quantised(postings.doc_id.data() + first, postings.wgt_q16.data() + first, last - first, shift, ctx.doc_first, int_scores, used_doc_idx, ctx.mtchbow_touched_docs.data(), num_touched);
+			}
+			for(int a=first;delta && a<last;a++)
+			{
+				int row = d.doc_id[a] - ctx.doc_first;
+				int_scores[row] += llround(delta_wgt[a] / unit);
+				bow_touch(d.doc_id[a], row, used_doc_idx, ctx.mtchbow_touched_docs.data(), num_touched);
+			}
+		});
+	}
+
+	//~ documents in index order, as the ranking below is not stable
+	std::sort(ctx.mtchbow_touched_docs.begin(), ctx.mtchbow_touched_docs.begin() + num_touched);
+	ctx.scoreset.resize(num_touched);
+	for(int u_idx=0;u_idx<num_touched;u_idx++)
+	{
+		int doc_idx = ctx.mtchbow_touched_docs[u_idx];
+		double score = image_db_scores[doc_idx - ctx.doc_first]/query_v_norm;
+		if(bits)
+		{
+			score = int_scores[doc_idx - ctx.doc_first] * unit / query_v_norm;
+			int_scores[doc_idx - ctx.doc_first] = 0;
+		}
+		image_db_scores[doc_idx - ctx.doc_first] = 0;
+		used_doc_idx[doc_idx - ctx.doc_first] = 0;
+		
+		ctx.scoreset[u_idx].first = 1.0;
+		ctx.scoreset[u_idx].second = doc_idx;
+
+		//~ avoids no-go zone
+		if( doc_idx <= ctx.start_l || doc_idx >= ctx.stop_l)
+			ctx.scoreset[u_idx].first = 1.0 - score;
+	}
+
+	rank_scores(ctx);
+ 	 
+ }
+
+
+// ---------------------------------------------------------
+
+//~ orders (raw score, document) pairs so that a heap keeps the lowest score on top
+static inline bool bow_heap_order(const std::pair <double, int> &x, const std::pair <double, int> &y)
+{
+	return(x.first > y.first);
+}
+
+// ---------------------------------------------------------
+
+//~ block-max WAND (Ding and Suel, SIGIR 2011): every document is scored by adding its weights in the order of the query words, as 
+//~ matching_bow_f does, so the kbest scores are the exhaustive ones to the last bit. Bounds are compared with the kbest-th raw score
+//~ with a relative slack that covers the rounding of the sums
+template <int F> void gflip_engine::matching_bow_wand(const std::vector <int> &query_v, query_context &ctx) const
+{
+	const int *doc = postings.doc_id.data();
+	const double *wgt = bow_weights <F> (postings).data();
+	std::vector <bow_cursor> &cursors = ctx.mtchbow_cursors;
+	std::vector <int> &order = ctx.mtchbow_order;
+	std::vector < std::pair <double, int> > &heap = ctx.mtchbow_heap;
+	
+	//~ one cursor per distinct query word, with the query norm from their counts
+	double query_v_norm = 1, qsum = 0;
+	ctx.mtchbow_query_words.assign(query_v.begin(), query_v.end());
+	std::sort(ctx.mtchbow_query_words.begin(), ctx.mtchbow_query_words.end());
+	cursors.clear();
+	ctx.num_postings = 0;
+	for(uint j=0;j<ctx.mtchbow_query_words.size();)
+	{
+		uint j_end = j;
+		while(j_end < ctx.mtchbow_query_words.size() && ctx.mtchbow_query_words[j_end] == ctx.mtchbow_query_words[j])
+			j_end++;
+		qsum += (double)(j_end - j) * (j_end - j);
+		
+		bow_cursor c;
+		int delta_first, delta_last;
+		c.word = ctx.mtchbow_query_words[j];
+		c.count = j_end - j;
+		shard_postings(c.word, ctx, c.pos, c.last, delta_first, delta_last);
+		c.max_wgt = c.count * postings.word_max_wgt[c.word];
+		int word_first = postings.word_offset[c.word];
+		c.block = postings.block_offset[c.word] + (c.pos - word_first) / POSTINGBLOCK_SIZE;
+		c.block_end = c.pos < c.last ? postings.block_offset[c.word] + (c.last - 1 - word_first) / POSTINGBLOCK_SIZE + 1 : c.block;
+		c.visited_block = -1;
+		ctx.num_blocks += c.block_end - c.block;
+		ctx.num_postings += (c.last - c.pos) + (delta_last - delta_first);
+		cursors.push_back(c);
+		j = j_end;
+	}
+	if(qsum != 0)
+		query_v_norm = sqrt(qsum);
+	
+	//~ cursor of every query word, from the distinct words
+	ctx.mtchbow_query_words.erase(std::unique(ctx.mtchbow_query_words.begin(), ctx.mtchbow_query_words.end()), ctx.mtchbow_query_words.end());
+	ctx.mtchbow_cursor_of.resize(query_v.size());
+	for(uint j=0;j<query_v.size();j++)
+		ctx.mtchbow_cursor_of[j] = std::lower_bound(ctx.mtchbow_query_words.begin(), ctx.mtchbow_query_words.end(), query_v[j]) - ctx.mtchbow_query_words.begin();
+	
+	//~ the documents of the no-go zone rank as no match
+	heap.clear();
+	auto offer = [&](int doc_idx, double raw)
+	{
+		std::pair <double, int> e ((doc_idx <= ctx.start_l || doc_idx >= ctx.stop_l) ? raw : 0, doc_idx);
+		if(heap.size() < kbest)
+		{
+			heap.push_back(e);
+			std::push_heap(heap.begin(), heap.end(), bow_heap_order);
+		}
+		else if(e.first > heap.front().first)
+		{
+			std::pop_heap(heap.begin(), heap.end(), bow_heap_order);
+			heap.back() = e;
+			std::push_heap(heap.begin(), heap.end(), bow_heap_order);
+		}
+	};
+	
+	//~ scans inserted after the last build, scored exhaustively
+	grow_buffer(ctx.mtchbow_scores, context_docs(ctx));
+	grow_buffer(ctx.mtchbow_used_doc_idx, context_docs(ctx));
+	grow_buffer(ctx.mtchbow_touched_docs, context_docs(ctx) + 1);
+	int num_touched = 0;
+	for(uint j=0;j<query_v.size();j++)
+	{
+		const delta_posting_list &d = delta_postings[query_v[j]];
+		allowed_postings(query_v[j], ctx, [&](bool delta, int first, int last)
+		{
+			if(delta)
+				bow_accumulate_scalar(d.doc_id.data() + first, bow_weights <F> (d).data() + first, last - first, ctx.doc_first, 
+									  ctx.mtchbow_scores.data(), ctx.mtchbow_used_doc_idx.data(), ctx.mtchbow_touched_docs.data(), num_touched);
+		});
+	}
+	for(int u_idx=0;u_idx<num_touched;u_idx++)
+	{
+		int row = ctx.mtchbow_touched_docs[u_idx] - ctx.doc_first;
+		offer(ctx.mtchbow_touched_docs[u_idx], ctx.mtchbow_scores[row]);
+		ctx.mtchbow_scores[row] = 0;
+		ctx.mtchbow_used_doc_idx[row] = 0;
+	}
+	
+	//~ moves a cursor to its first document >= target, skipping whole blocks on their last document
+	auto advance = [&](bow_cursor &c, int target)
+	{
+		while(c.block < c.block_end && postings.block_last_doc[c.block] < target)
+			c.block++;
+		if(c.block == c.block_end)
+		{
+			c.pos = c.last;
+			return;
+		}
+		int block_first = postings.word_offset[c.word] + (c.block - postings.block_offset[c.word]) * POSTINGBLOCK_SIZE;
+		int from = std::max(c.pos, block_first), to = std::min(c.last, block_first + POSTINGBLOCK_SIZE);
+		c.pos = std::lower_bound(doc + from, doc + to, target) - doc;
+		if(c.pos < c.last && c.block != c.visited_block)
+		{
+			c.visited_block = c.block;
+			ctx.num_skipped_blocks--;
+		}
+	};
+	auto by_doc = [&](int x, int y) {return(doc[cursors[x].pos] < doc[cursors[y].pos]);};
+	
+	//~ the first posting of every word is read
+	ctx.num_skipped_blocks += ctx.num_blocks;
+	order.clear();
+	for(uint i=0;i<cursors.size();i++)
+		if(cursors[i].pos < cursors[i].last)
+		{
+			cursors[i].visited_block = cursors[i].block;
+			ctx.num_skipped_blocks--;
+			order.push_back(i);
+		}
+	std::sort(order.begin(), order.end(), by_doc);
+	
+	while(order.size())
+	{
+		double threshold = heap.size() < kbest ? -1 : heap.front().first;
+		
+		//~ pivot: the first document whose bound from the largest weights of the words reaching it beats the threshold
+		double bound = 0;
+		uint p = 0;
+		while(p < order.size() && (bound += cursors[order[p]].max_wgt) * (1 + BOWBLOCKMAX_SLACK) <= threshold)
+			p++;
+		if(p == order.size())
+			break;
+		int pivot_doc = doc[cursors[order[p]].pos];
+		while(p + 1 < order.size() && doc[cursors[order[p+1]].pos] == pivot_doc)
+			p++;
+		
+		//~ documents the filter disallows are jumped over
+		int allowed = ctx.filter ? ctx.filter->next_allowed(pivot_doc) : pivot_doc;
+		if(allowed != pivot_doc)
+		{
+			for(uint i=0;i<=p;i++)
+				advance(cursors[order[i]], allowed);
+		}
+		else
+		{
+			//~ tighter bound from the blocks holding the pivot document, valid up to the end of the first of them to end
+			bound = 0;
+			int next_doc = p + 1 < order.size() ? doc[cursors[order[p+1]].pos] : INT_MAX;
+			for(uint i=0;i<=p;i++)
+			{
+				bow_cursor &c = cursors[order[i]];
+				while(c.block < c.block_end - 1 && postings.block_last_doc[c.block] < pivot_doc)
+					c.block++;
+				bound += c.count * postings.block_max_wgt[c.block];
+				next_doc = std::min(next_doc, postings.block_last_doc[c.block] + 1);
+			}
+			
+			if(bound * (1 + BOWBLOCKMAX_SLACK) <= threshold)
+			{
+				for(uint i=0;i<=p;i++)
+					advance(cursors[order[i]], next_doc);
+			}
+			else if(doc[cursors[order[0]].pos] == pivot_doc)
+			{
+				double raw = 0;
+				for(uint j=0;j<query_v.size();j++)
+				{
+					const bow_cursor &c = cursors[ctx.mtchbow_cursor_of[j]];
+					if(c.pos < c.last && doc[c.pos] == pivot_doc)
+						raw += wgt[c.pos];
+				}
+				offer(pivot_doc, raw);
+				for(uint i=0;i<=p;i++)
+					advance(cursors[order[i]], pivot_doc + 1);
+			}
+			else
+			{
+				for(uint i=0;doc[cursors[order[i]].pos] < pivot_doc;i++)
+					advance(cursors[order[i]], pivot_doc);
+			}
+		}
+		
+		//~ only the first cursors moved, the order is restored by insertion
+		order.erase(std::remove_if(order.begin(), order.end(), [&](int i) {return(cursors[i].pos == cursors[i].last);}), order.end());
+		for(int i=std::min(p, (uint)order.size());i>=0;i--)
+			for(uint k=i;k+1<order.size() && by_doc(order[k+1], order[k]);k++)
+				std::swap(order[k], order[k+1]);
+	}
+	
+	//~ only the kbest are listed
+	ctx.scoreset.resize(heap.size());
+	for(uint i=0;i<heap.size();i++)
+	{
+		int doc_idx = heap[i].second;
+		ctx.scoreset[i].first = 1.0;
+		ctx.scoreset[i].second = doc_idx;
+		if( doc_idx <= ctx.start_l || doc_idx >= ctx.stop_l)
+			ctx.scoreset[i].first = 1.0 - heap[i].first/query_v_norm;
+	}
+	rank_scores(ctx);
+}
+
+// ---------------------------------------------------------
+
+ 
+void gflip_engine::check_index_profile(int dtype) const
+{
+	if( (dtype == 1 && !index_has_bow()) || (dtype == 2 && !index_has_gfp()) )
+	{
+		std::cout << "Error: matching method " << dtype << " not available with index profile " << index_profile << std::endl;
+		exit(1);
+	}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::match(int dtype, const std::vector <int> &query_v, query_context &ctx) const
+{
+	if(dtype ==1)
+		matching_bow(query_v, ctx);
+	if(dtype ==2)
+		matching_gfp(query_v, ctx);
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::query(int dtype, const std::vector <int> &query_v, query_context &ctx) const
+{
+	check_index_profile(dtype);
+
+	//~ avoids any skip 
+	ctx.start_l = 0; 
+	ctx.stop_l = 0;
+	//~ does the search
+	if(query_shards > 1 && postings.num_docs >= query_shards)
+		match_sharded(dtype, query_v, ctx);
+	else
+		match(dtype, query_v, ctx);
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::query(int dtype, const std::vector <int> &query_v, const doc_filter &filter, query_context &ctx) const
+{
+	check_index_profile(dtype);
+
+	ctx.start_l = 0; 
+	ctx.stop_l = 0;
+	
+	//~ the documents matched span the allowed ranges, a single range needs no filter
+	ctx.doc_first = filter.ranges.size() ? std::min(postings.num_docs, std::max(0, filter.ranges.front().first)) : 0;
+	ctx.doc_last = filter.ranges.size() ? std::max(ctx.doc_first, std::min(postings.num_docs, filter.ranges.back().second)) : 0;
+	ctx.filter = filter.ranges.size() > 1 ? &filter : NULL;
+	if(query_shards > 1 && ctx.doc_last - ctx.doc_first >= query_shards)
+		match_sharded(dtype, query_v, ctx);
+	else
+		match(dtype, query_v, ctx);
+	
+	//~ the next queries of the context match all the documents
+	ctx.doc_first = 0;
+	ctx.doc_last = INT_MAX;
+	ctx.filter = NULL;
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::match_sharded(int dtype, const std::vector <int> &query_v, query_context &ctx) const
+{
+	//~ every shard ranks its own matches
+	long span = std::min(postings.num_docs, ctx.doc_last) - ctx.doc_first;
+	ctx.shard_contexts.resize(query_shards);
+	parallel_ranges(query_shards, query_shards, [&](long first, long last, int s)
+	{
+		query_context &shard = ctx.shard_contexts[s];
+		shard.doc_first = ctx.doc_first + span * s / query_shards;
+		shard.doc_last = ctx.doc_first + span * (s+1) / query_shards;
+		shard.filter = ctx.filter;
+		shard.start_l = ctx.start_l;
+		shard.stop_l = ctx.stop_l;
+		match(dtype, query_v, shard);
+	});
+	
+	//~ merge: the kbest results are among the kbest best of each shard, which are put first and ranked, the other matches follow
+	ctx.scoreset.clear();
+	ctx.num_postings = 0;
+	ctx.num_skipped_postings = 0;
+	ctx.num_blocks = 0;
+	ctx.num_skipped_blocks = 0;
+	bool top_only = !full_ranking && kbest > 0;
+	for(int s=0;s<query_shards;s++)
+	{
+		const std::vector < std::pair <double, int> > &r = ctx.shard_contexts[s].scoreset;
+		ctx.num_postings += ctx.shard_contexts[s].num_postings;
+		ctx.num_skipped_postings += ctx.shard_contexts[s].num_skipped_postings;
+		ctx.num_blocks += ctx.shard_contexts[s].num_blocks;
+		ctx.num_skipped_blocks += ctx.shard_contexts[s].num_skipped_blocks;
+		ctx.scoreset.insert(ctx.scoreset.end(), r.begin(), r.begin() + (top_only ? std::min(r.size(), (size_t)kbest) : r.size()));
+	}
+	size_t num_top = ctx.scoreset.size();
+	for(int s=0;top_only && s<query_shards;s++)
+	{
+		const std::vector < std::pair <double, int> > &r = ctx.shard_contexts[s].scoreset;
+		if(r.size() > kbest)
+			ctx.scoreset.insert(ctx.scoreset.end(), r.begin() + kbest, r.end());
+	}
+	sort(ctx.scoreset.begin(), ctx.scoreset.begin() + num_top, isBettermatched);
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::query(int dtype, std::vector <int> &query_v, std::vector < std::pair <double, int> > **scoreoutput)
+{
+	query(dtype, query_v, default_context);
+	*scoreoutput = &default_context.scoreset;	
+}
+
+// ---------------------------------------------------------
+
+long gflip_engine::get_gfp_row_bytes(void) const
+{
+	long doc_bytes = max_bow_len * (sizeof(int) + sizeof(double)) + 2 * sizeof(int) + sizeof(char);
+	if(gfp_pruning > 0)
+		doc_bytes += sizeof(int) + sizeof(double);
+	return(postings.num_docs * doc_bytes);
+}
+
+// ---------------------------------------------------------
+
+int gflip_engine::query_threads(int dtype, long num_queries) const
+{
+	long nthreads = std::max(1L, std::min((long)num_threads, num_queries));
+	
+	//~ every thread keeps its own dense rows over the whole dataset
+	if(dtype == 2 && gfp_engine == 0 && gfp_row_memory > 0)
+		nthreads = std::max(1L, std::min(nthreads, (gfp_row_memory << 20) / std::max(1L, get_gfp_row_bytes())));
+	return(nthreads);
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::query_batch(int dtype, const std::vector < std::vector <int> > &queries, std::vector < std::vector < std::pair <double, int> > > &results)
+{
+	check_index_profile(dtype);
+
+	long n = queries.size();
+	results.resize(n);
+	int nthreads = query_threads(dtype, n);
+	if((int)batch_contexts.size() < nthreads)
+		batch_contexts.resize(nthreads);
+	
+	parallel_stealing(n, nthreads, [&](long i, int t)
+	{
+		query_context &ctx = batch_contexts[t];
+		ctx.start_l = 0;
+		ctx.stop_l = 0;
+		match(dtype, queries[i], ctx);
+		
+		size_t k = ctx.scoreset.size();
+		if(!full_ranking && kbest > 0)
+			k = std::min(k, (size_t)kbest);
+		results[i].assign(ctx.scoreset.begin(), ctx.scoreset.begin() + k);
+	});
+}
+
+// ---------------------------------------------------------
+
+
+
+void gflip_engine::run_evaluation(int dtype)
+{
+	check_index_profile(dtype);
+
+	struct timeval tim_st;  
+	char nosave = 0;
+
+	char buff[2000];
+	sprintf(buff,"./%s.nn", fileoutput_rootname.c_str());
+	FILE *f = NULL;
+	
+	if(!nosave)
+		f=fopen(buff, "wt");
+	
+	int nthreads = query_threads(dtype, number_of_scans);
+	if((int)batch_contexts.size() < nthreads)
+		batch_contexts.resize(nthreads);
+	if(dtype == 2 && gfp_engine == 0)
+		std::cout << "GFP dense rows: " << get_gfp_row_bytes()/1024 << " kB per thread, " << nthreads << " of " << num_threads << " threads"
+				  << (nthreads < std::min(num_threads, (int)number_of_scans) ? " (bounded by the row memory)" : "") << std::endl;
+	
+	//~ line of the .nn file and time of every query, written in scan order once all are done
+	std::vector <std::string> nn_line (number_of_scans);
+	std::vector <double> query_time (number_of_scans, -1);
+	std::vector <long> num_postings (nthreads, 0), num_skipped_postings (nthreads, 0), num_blocks (nthreads, 0), num_skipped_blocks (nthreads, 0);
+	gettimeofday(&tim_st, NULL);  
+	parallel_stealing(number_of_scans, nthreads, [&](long i, int t)
+	{
+		//~ match this query,just the seq found
+		const std::vector <int> &query_v  = laserscan_bow[i].w;
+
+		//~ if 0 len
+		if(!query_v.size())
+			return;
+
+		//~ exclude the i scan
+		query_context &ctx = batch_contexts[t];
+		ctx.start_l = i-1; 
+		ctx.stop_l = i+1;
+
+		//~ match with several techs
+		struct timeval tim_qry;
+    	gettimeofday(&tim_qry, NULL);  
+		match(dtype, query_v, ctx);
+		query_time[i] = elapsed_since(tim_qry);
+		num_postings[t] += ctx.num_postings;
+		num_skipped_postings[t] += ctx.num_skipped_postings;
+		num_blocks[t] += ctx.num_blocks;
+		num_skipped_blocks[t] += ctx.num_skipped_blocks;
+		if(!nosave)
+		{
+			char num[64];
+			sprintf(num, "%d %d %7.7f ", kbest, (int)ctx.scoreset.size(), query_time[i]);
+			nn_line[i] = num;
+			uint minscoresetsize = std::min((int)kbest,(int)ctx.scoreset.size());
+			for(uint ii=0;ii<minscoresetsize;ii++)
+			{
+				sprintf(num, "%d ", ctx.scoreset[ii].second);
+				nn_line[i] += num;
+			}
+		}
+	});
+	double dtime_wall = elapsed_since(tim_st);
+		
+	double dtime_avg=0;
+	int countv=0;
+	for(uint i=0;i<number_of_scans;i++)
+	{
+		if(!nosave)
+			fprintf (f, "%s\n", nn_line[i].c_str());
+		if(query_time[i] >= 0)
+		{
+			dtime_avg += query_time[i];
+			countv++;
+		}
+	}
+	std::cout << "Averge query time: "<< (double)dtime_avg/(double)countv << " total  time: " << dtime_avg << " # scans: " << countv << std::endl;
+	std::cout << "Queries run on " << nthreads << " threads in " << dtime_wall << " s: " << countv / dtime_wall << " queries/s, " 
+			  << "effective parallelism (total query time / elapsed time): " << dtime_avg / dtime_wall << std::endl;
+	if(dtype == 2 && gfp_pruning > 0)
+	{
+		long total = 0, skipped = 0;
+		for(int t=0;t<nthreads;t++)
+		{
+			total += num_postings[t];
+			skipped += num_skipped_postings[t];
+		}
+		std::cout << "GFP pruning skipped " << skipped << " of " << total << " postings (" << 100.0 * skipped / std::max(1L, total) << "%)" << std::endl;
+	}
+	if(dtype == 1 && bow_block_max && !postings.word_max_wgt.empty())
+	{
+		long total = 0, skipped = 0;
+		for(int t=0;t<nthreads;t++)
+		{
+			total += num_blocks[t];
+			skipped += num_skipped_blocks[t];
+		}
+		std::cout << "Block-max WAND skipped " << skipped << " of " << total << " posting blocks (" << 100.0 * skipped / std::max(1L, total) << "%)" << std::endl;
+	}
+	if(!nosave)
+		fclose(f);
+}
+
+// ---------------------------------------------------------
+
+double gflip_engine::topk_overlap(int dtype, const gflip_engine &reference) const
+{
+	check_index_profile(dtype);
+	reference.check_index_profile(dtype);
+	
+	int nthreads = std::max(1, std::min(num_threads, (int)number_of_scans));
+	std::vector <query_context> ctx (nthreads), ref_ctx (nthreads);
+	std::vector <long> num_shared (nthreads, 0), num_ref (nthreads, 0);
+	parallel_stealing(number_of_scans, nthreads, [&](long i, int t)
+	{
+		const std::vector <int> &query_v  = laserscan_bow[i].w;
+		if(!query_v.size())
+			return;
+		
+		//~ same queries as run_evaluation on both engines
+		ctx[t].start_l = ref_ctx[t].start_l = i-1; 
+		ctx[t].stop_l = ref_ctx[t].stop_l = i+1;
+		match(dtype, query_v, ctx[t]);
+		reference.match(dtype, query_v, ref_ctx[t]);
+		
+		std::vector <int> top, ref_top;
+		for(uint ii=0;ii<std::min((size_t)kbest, ctx[t].scoreset.size());ii++)
+			top.push_back(ctx[t].scoreset[ii].second);
+		for(uint ii=0;ii<std::min((size_t)kbest, ref_ctx[t].scoreset.size());ii++)
+			ref_top.push_back(ref_ctx[t].scoreset[ii].second);
+		std::sort(top.begin(), top.end());
+		std::sort(ref_top.begin(), ref_top.end());
+		std::vector <int> shared;
+		std::set_intersection(top.begin(), top.end(), ref_top.begin(), ref_top.end(), std::back_inserter(shared));
+		num_shared[t] += shared.size();
+		num_ref[t] += ref_top.size();
+	});
+	
+	long shared = 0, total = 0;
+	for(int t=0;t<nthreads;t++)
+	{
+		shared += num_shared[t];
+		total += num_ref[t];
+	}
+	return(total ? (double)shared / total : 1.0);
+}
+
+ 
+ 
+
+// ---------------------------------------------------------
+
+
+void gflip_engine::count_postings(uint first, uint last, std::vector <int> &num_postings, std::vector <int> &num_pos)
+{
+	//~ word_seen marks the words already counted in the current document; negative word ids are not indexed
+	std::vector <char> word_seen (num_postings.size(), 0);
+	for(uint i=first;i<last;i++)
+	{
+		std::vector <int> &w = laserscan_bow[i].w;
+		for(uint j=0;j<w.size();j++)
+		{
+			if(w[j] < 0)
+				continue;
+			if(!word_seen[w[j]])
+			{
+				word_seen[w[j]] = 1;
+				num_postings[w[j]]++;
+			}
+			num_pos[w[j]]++;
+		}
+		for(uint j=0;j<w.size();j++)
+			if(w[j] >= 0)
+				word_seen[w[j]] = 0;
+	}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::fill_postings(uint first, uint last, std::vector <int> &next_posting, std::vector <int> &next_pos)
+{
+	//~ single pass over the scans: postings are emitted in document order at next_posting[word_id], word_slot
+	//~ keeps the posting of each word in the current document (-1 if not yet seen). The word orders of a posting 
+	//~ are contiguous because the next posting of the same word belongs to a later document
+	std::vector <int> word_slot (next_posting.size(), -1);
+	bool with_counts = index_has_bow(), with_pos = index_has_gfp();
+	for(uint i=first;i<last;i++)
+	{
+		std::vector <int> &w = laserscan_bow[i].w;
+		for(uint j=0;j<w.size();j++)
+		{
+			int word_id = w[j];
+			if(word_id < 0)
+				continue;
+			if(word_slot[word_id] < 0)
+			{
+				int slot = next_posting[word_id]++;
+				word_slot[word_id] = slot;
+				postings.doc_id[slot] = i;
+				if(with_counts)
+					postings.term_count_unnormalized[slot] = 0;
+				if(with_pos)
+					postings.pos_offset[slot] = next_pos[word_id];
+			}
+			if(with_counts)
+				postings.term_count_unnormalized[word_slot[word_id]]++;
+			if(with_pos)
+				postings.pos[next_pos[word_id]++] = j;
+		}
+		
+		//~ reset the slots
+		for(uint j=0;j<w.size();j++)
+			if(w[j] >= 0)
+				word_slot[w[j]] = -1;
+	}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::build_doc_postings(void)
+{
+	//~ documents are filled walking the words in id order, so every document gets its words sorted
+	doc_postings.offset.assign(laserscan_bow.size()+1, 0);
+	for(uint h=0;h<postings.doc_id.size();h++)
+		doc_postings.offset[postings.doc_id[h]+1]++;
+	for(uint i=0;i<laserscan_bow.size();i++)
+		doc_postings.offset[i+1] += doc_postings.offset[i];
+	
+	std::vector <int> fill (doc_postings.offset.begin(), doc_postings.offset.end()-1);
+	doc_postings.word_id.resize(doc_postings.offset.back());
+	doc_postings.posting.resize(doc_postings.offset.back());
+	for(uint word_id=0;word_id<tf_idf.size();word_id++)
+		for(int h=postings.word_offset[word_id];h<postings.word_offset[word_id+1];h++)
+		{
+			int e = fill[postings.doc_id[h]]++;
+			doc_postings.word_id[e] = word_id;
+			doc_postings.posting[e] = h;
+		}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::tfidf_weights(int doc_id, int n, const int *word_id, const int *term_count, double *wgt, double *wgt_wf, double *wgt_vss)
+{
+	double num_words = laserscan_bow[doc_id].w.size();
+	
+	//~ tfsmoothing
+	double mxtf_val = -DBL_MAX;
+	for(int e=0;e<n;e++)
+		if( term_count[e] > mxtf_val )
+			mxtf_val = term_count[e];
+
+	//~ normedtfidf, wtfidf
+	//~ sum
+	double sum=0,sum_wf=0,sum_vss=0;
+	for(int e=0;e<n;e++)
+	{
+		double idf = tf_idf[word_id[e]].idf;
+		double val = (term_count[e] / num_words * idf);
+		double val_wf = (1 + log(term_count[e]) ) * idf;
+		double val_vss = alpha_vss + ( (1.0 - alpha_vss) * term_count[e] ) / mxtf_val;
+		sum+=val*val;
+		sum_wf+=val_wf*val_wf;
+		sum_vss+=val_vss*val_vss;
+	}
+				
+	//~ norm
+	double norm=sqrt(sum);
+	double norm_wf=sqrt(sum_wf);
+	double norm_vss=sqrt(sum_vss);
+	double versum=0, versum_wf=0, versum_vss=0;
+	for(int e=0;e<n;e++)
+	{
+		double idf = tf_idf[word_id[e]].idf;
+		wgt[e]=(term_count[e] / num_words * idf)/norm;
+		wgt_wf[e]=((1 + log(term_count[e]) )  * idf)/norm_wf;
+		wgt_vss[e]=( alpha_vss + ( (1.0 - alpha_vss) * term_count[e] ) / mxtf_val) / norm_vss;
+		
+		versum += wgt[e]*wgt[e];
+		versum_wf += wgt_wf[e]*wgt_wf[e];
+		versum_vss += wgt_vss[e]*wgt_vss[e];
+	}
+
+	//~ verification			
+	if( index_has_weights(0) && fabs(sqrt(versum) -1 ) > 0.00001 && sum > 0.00001 )
+	{
+		std::cout << "ERROR NORMALIZ FAIL "<<sqrt(versum)<< " "<< doc_id<< " "<< laserscan_bow[doc_id].w.size() << std::endl;
+		exit(1);
+	}
+	
+	if( index_has_weights(1) && fabs(sqrt(versum_wf) -1 ) > 0.00001 && sum_wf > 0.00001 )
+	{
+		std::cout << "ERROR WFIDF NORMALIZ FAIL "<<sqrt(versum_wf)<< " "<< doc_id<< " "<< laserscan_bow[doc_id].w.size() << std::endl;
+		exit(1);
+	}
+
+	if( index_has_weights(2) && fabs(sqrt(versum_vss) -1 ) > 0.00001 && sum_vss > 0.00001 )
+	{
+		std::cout << "ERROR VSSIDF NORMALIZ FAIL "<<sqrt(versum_vss)<< " "<< doc_id<< " "<< laserscan_bow[doc_id].w.size() << std::endl;
+		exit(1);
+	}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::normalise_tfidf(int first_doc, int last_doc)
+{
+	bool with_tf = index_has_weights(0), with_wf = index_has_weights(1), with_vss = index_has_weights(2);
+	std::vector <int> term_count;
+	std::vector <double> wgt, wgt_wf, wgt_vss;
+	for(int doc_id=first_doc;doc_id<last_doc;doc_id++)
+	{
+		int e_first = doc_postings.offset[doc_id];
+		int n = doc_postings.offset[doc_id+1] - e_first;
+		term_count.resize(n);
+		wgt.resize(n);
+		wgt_wf.resize(n);
+		wgt_vss.resize(n);
+		for(int e=0;e<n;e++)
+			term_count[e] = postings.term_count_unnormalized[doc_postings.posting[e_first+e]];
+		
+		tfidf_weights(doc_id, n, &doc_postings.word_id[e_first], term_count.data(), wgt.data(), wgt_wf.data(), wgt_vss.data());
+		
+		for(int e=0;e<n;e++)
+		{
+			int h = doc_postings.posting[e_first+e];
+			if(with_tf)
+				postings.tf_idf_doc_normed[h]=wgt[e];
+			if(with_wf)
+				postings.wf_idf_doc_normed[h]=wgt_wf[e];
+			if(with_vss)
+				postings.ntf_idf_doc_normed[h]=wgt_vss[e];
+		}
+	}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::build_tfidf(void)
+{
+	struct timeval tim_st;
+	gettimeofday(&tim_st, NULL);
+
+	//~ the stats of the previous build, pruning counts included, start over
+	build_stats = index_build_stats();
+
+	//~ find id size, maxlen
+	int maxid= -1;
+	int maxid_idx = -1;
+	max_bow_len = -INT_MAX;
+
+	for(uint i=0;i<laserscan_bow.size();i++)
+	{
+		for(uint j=0;j<laserscan_bow[i].w.size();j++)
+		{
+			if(laserscan_bow[i].w[j] > maxid)
+			{
+				maxid = laserscan_bow[i].w[j];
+				maxid_idx = i;
+			}
+		
+		}
+			
+		if((int)laserscan_bow[i].w.size() > max_bow_len)
+			max_bow_len=laserscan_bow[i].w.size();			
+	}
+	//~ include last number
+	maxid+=1;
+	dictionary_dimensions = maxid;
+	//~ do it large
+	max_bow_len = (max_bow_len+1)*2;
+	if(build_messages)
+	{
+		std::cout << "Detected dictionary dimension: "<< maxid << " @ "<< maxid_idx << std::endl;
+		std::cout << "Detected max bow len : "<< max_bow_len << std::endl;
+	}
+
+	tf_idf = std::vector <tf_idf_db> (maxid);
+	int nthreads = std::min(num_threads, (int)laserscan_bow.size());
+	
+	//~ each thread counts the postings and word orders of a contiguous block of scans, the prefix sums give 
+	//~ every block its first slot per word, so the blocks fill disjoint slots and the result is the same as the serial build
+	int nblocks = std::max(nthreads, 1);
+	std::vector < std::vector <int> > next_posting (nblocks, std::vector <int> (maxid, 0));
+	std::vector < std::vector <int> > next_pos (nblocks, std::vector <int> (maxid, 0));
+	parallel_ranges(laserscan_bow.size(), nthreads, [&](int first, int last, int t)
+	{
+		count_postings(first, last, next_posting[t], next_pos[t]);
+	});
+	
+	postings = posting_index();
+	postings.num_docs = laserscan_bow.size();
+	postings.word_offset.resize(maxid+1);
+	int num_postings = 0, num_pos = 0;
+	for(int word_id=0; word_id<maxid; word_id++)
+	{
+		postings.word_offset[word_id] = num_postings;
+		for(int t=0;t<nblocks;t++)
+		{
+			int cnt = next_posting[t][word_id];
+			next_posting[t][word_id] = num_postings;
+			num_postings += cnt;
+			
+			int pcnt = next_pos[t][word_id];
+			next_pos[t][word_id] = num_pos;
+			num_pos += pcnt;
+		}
+	}
+	postings.word_offset[maxid] = num_postings;
+	postings.doc_id.resize(num_postings);
+	if(index_has_bow())
+		postings.term_count_unnormalized.resize(num_postings);
+	if(index_has_weights(0))
+		postings.tf_idf_doc_normed.resize(num_postings, -1);
+	if(index_has_weights(1))
+		postings.wf_idf_doc_normed.resize(num_postings, -1);
+	if(index_has_weights(2))
+		postings.ntf_idf_doc_normed.resize(num_postings, -1);
+	if(index_has_gfp())
+	{
+		postings.pos_offset.resize(num_postings+1);
+		postings.pos_offset[num_postings] = num_pos;
+		postings.pos.resize(num_pos);
+	}
+	
+	parallel_ranges(laserscan_bow.size(), nthreads, [&](int first, int last, int t)
+	{
+		fill_postings(first, last, next_posting[t], next_pos[t]);
+	});
+	
+	build_stats.num_postings = num_postings;
+	for(int word_id=0; word_id<maxid; word_id++)
+	{
+		tf_idf[word_id].num_doc_containing_the_word = postings.word_offset[word_id+1] - postings.word_offset[word_id];
+		tf_idf[word_id].corpus_size = laserscan_bow.size();
+		tf_idf[word_id].idf = log( (double)tf_idf[word_id].corpus_size / (double) tf_idf[word_id].num_doc_containing_the_word );
+	}
+	build_stats.postings_time = elapsed_since(tim_st);
+	
+	if(index_has_bow())
+	{
+		//~ per document normalisations through the forward index, every document only writes its own postings
+		build_doc_postings();
+		parallel_ranges(laserscan_bow.size(), nthreads, [&](int first, int last, int t)
+		{
+			normalise_tfidf(first, last);
+		});
+		//~ only needed while normalising
+		doc_postings = doc_postings_db();
+	}
+
+	//~ verification
+	for(uint i=0;i<tf_idf.size() && index_has_bow();i++)
+		for(int h=postings.word_offset[i];h<postings.word_offset[i+1];h++)
+		{
+			if(index_has_weights(0) && postings.tf_idf_doc_normed[h] < 0)
+			{
+				std::cout << "ERROR NORMALIZ NO INT"<<std::endl;
+				exit(1);
+			}
+			if(index_has_weights(1) && postings.wf_idf_doc_normed[h] < 0)
+			{
+				std::cout << "ERROR wf_idf NO INT"<< i << " "<< h << " "<< postings.wf_idf_doc_normed[h] << " "<<  std::endl;
+				exit(1);
+			}
+			if(index_has_weights(2) && postings.ntf_idf_doc_normed[h] < 0)
+			{
+				std::cout << "ERROR vss NO INT"<< i << " "<< h << " "<< postings.ntf_idf_doc_normed[h] << " "<<  std::endl;
+				exit(1);
+			}
+			
+		}
+	
+	prune_words();
+	build_posting_blocks();
+	quantise_bow_weights();
+	
+	build_stats.build_time = elapsed_since(tim_st);
+	build_stats.index_memory_bytes = postings.memory_bytes();
+	build_stats.peak_memory_kb = peak_memory_kb();
+	if(!build_messages)
+		return;
+	std::cout << "Index built in "<< build_stats.build_time << " s (postings: " << build_stats.postings_time << " s), # postings: " << build_stats.num_postings << ", index size: " << build_stats.index_memory_bytes/1024 << " kB, peak memory: " << build_stats.peak_memory_kb << " kB" << std::endl;
+	if(build_stats.num_pruned_words)
+		std::cout << "Pruned " << build_stats.num_pruned_words << " words: " << build_stats.num_pruned_postings << " postings removed (" 
+				  << 100.0 * build_stats.num_pruned_postings / (build_stats.num_postings + build_stats.num_pruned_postings) << "%)" << std::endl;
+}
+
+// ---------------------------------------------------------
+
+bool gflip_engine::word_pruned(int word_id) const
+{
+	//~ a word of the last build without postings
+	return(tf_idf[word_id].num_doc_containing_the_word > 0 && postings.word_offset[word_id] == postings.word_offset[word_id+1] && delta_postings[word_id].doc_id.empty());
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::prune_words(void)
+{
+	if(prune_min_idf <= 0 && prune_max_df >= 1)
+		return;
+	
+	//~ the kept postings and word orders are moved down in place, in word order
+	bool with_counts = index_has_bow(), with_pos = index_has_gfp();
+	int dst = 0, dst_pos = 0;
+	for(uint word_id=0;word_id<tf_idf.size();word_id++)
+	{
+		int first = postings.word_offset[word_id], last = postings.word_offset[word_id+1];
+		postings.word_offset[word_id] = dst;
+		if(tf_idf[word_id].idf < prune_min_idf || tf_idf[word_id].num_doc_containing_the_word > prune_max_df * postings.num_docs)
+		{
+			build_stats.num_pruned_words++;
+			build_stats.num_pruned_postings += last - first;
+			continue;
+		}
+		for(int h=first;h<last;h++,dst++)
+		{
+			postings.doc_id[dst] = postings.doc_id[h];
+			if(with_counts)
+				postings.term_count_unnormalized[dst] = postings.term_count_unnormalized[h];
+			if(index_has_weights(0))
+				postings.tf_idf_doc_normed[dst] = postings.tf_idf_doc_normed[h];
+			if(index_has_weights(1))
+				postings.wf_idf_doc_normed[dst] = postings.wf_idf_doc_normed[h];
+			if(index_has_weights(2))
+				postings.ntf_idf_doc_normed[dst] = postings.ntf_idf_doc_normed[h];
+			if(with_pos)
+			{
+				int pos_first = postings.pos_offset[h], pos_last = postings.pos_offset[h+1];
+				postings.pos_offset[dst] = dst_pos;
+				for(int a=pos_first;a<pos_last;a++)
+					postings.pos[dst_pos++] = postings.pos[a];
+			}
+		}
+	}
+	postings.word_offset[tf_idf.size()] = dst;
+	
+	postings.doc_id.resize(dst);
+	if(with_counts)
+		postings.term_count_unnormalized.resize(dst);
+	if(index_has_weights(0))
+		postings.tf_idf_doc_normed.resize(dst);
+	if(index_has_weights(1))
+		postings.wf_idf_doc_normed.resize(dst);
+	if(index_has_weights(2))
+		postings.ntf_idf_doc_normed.resize(dst);
+	if(with_pos)
+	{
+		postings.pos_offset.resize(dst+1);
+		postings.pos_offset[dst] = dst_pos;
+		postings.pos.resize(dst_pos);
+	}
+	build_stats.num_postings = dst;
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::build_posting_blocks(void)
+{
+	postings.block_offset = index_array <int> ();
+	postings.block_last_doc = index_array <int> ();
+	if(postings.word_offset.empty())
+	{
+		build_block_max();
+		return;
+	}
+	
+	//~ skip pointers; the postings of a loaded index are read through const references, so they stay mapped
+	const index_array <int> &word_offset = postings.word_offset, &doc_id = postings.doc_id;
+	uint num_words = word_offset.size() - 1;
+	postings.block_offset.resize(num_words + 1);
+	for(uint word_id=0;word_id<num_words;word_id++)
+	{
+		int n = word_offset[word_id+1] - word_offset[word_id];
+		postings.block_offset[word_id+1] = postings.block_offset[word_id] + (n + POSTINGBLOCK_SIZE - 1) / POSTINGBLOCK_SIZE;
+	}
+	postings.block_last_doc.resize(postings.block_offset[num_words]);
+	for(uint word_id=0;word_id<num_words;word_id++)
+		for(int b=postings.block_offset[word_id];b<postings.block_offset[word_id+1];b++)
+		{
+			int first = word_offset[word_id] + (b - postings.block_offset[word_id]) * POSTINGBLOCK_SIZE;
+			postings.block_last_doc[b] = doc_id[std::min(first + POSTINGBLOCK_SIZE, word_offset[word_id+1]) - 1];
+		}
+	build_block_max();
+}
+
+// ---------------------------------------------------------
+
+//~ block-max WAND bounds, on the blocks of the skip pointers
+void gflip_engine::build_block_max(void)
+{
+	postings.block_max_wgt = index_array <double> ();
+	postings.word_max_wgt = index_array <double> ();
+	if(!index_has_block_max() || postings.word_offset.empty())
+		return;
+	
+	const index_array <int> &word_offset = postings.word_offset, &block_offset = postings.block_offset;
+	uint num_words = word_offset.size() - 1;
+	const index_array <double> &wgt = bow_subtype == 0 ? postings.tf_idf_doc_normed : bow_subtype == 1 ? postings.wf_idf_doc_normed : postings.ntf_idf_doc_normed;
+	postings.block_max_wgt.resize(block_offset[num_words]);
+	postings.word_max_wgt.resize(num_words);
+	for(uint word_id=0;word_id<num_words;word_id++)
+	{
+		double word_max = 0;
+		for(int b=block_offset[word_id];b<block_offset[word_id+1];b++)
+		{
+			int first = word_offset[word_id] + (b - block_offset[word_id]) * POSTINGBLOCK_SIZE;
+			int last = std::min(first + POSTINGBLOCK_SIZE, word_offset[word_id+1]);
+			double max_wgt = 0;
+			for(int h=first;h<last;h++)
+				max_wgt = std::max(max_wgt, wgt[h]);
+			postings.block_max_wgt[b] = max_wgt;
+			word_max = std::max(word_max, max_wgt);
+		}
+		postings.word_max_wgt[word_id] = word_max;
+	}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::quantise_bow_weights(void)
+{
+	if(!bow_quantisation || !index_has_bow())
+		return;
+	if(bow_quantisation != 8 && bow_quantisation != 16)
+	{
+		std::cout << "Error: bag-of-words weights are quantised to 8 or 16 bits, not " << bow_quantisation << std::endl;
+		exit(1);
+	}
+	
+	const index_array <double> &wgt = bow_subtype == 0 ? postings.tf_idf_doc_normed : bow_subtype == 1 ? postings.wf_idf_doc_normed : postings.ntf_idf_doc_normed;
+	const index_array <int> &word_offset = postings.word_offset;
+	long double_bytes = (postings.tf_idf_doc_normed.size() + postings.wf_idf_doc_normed.size() + postings.ntf_idf_doc_normed.size()) * sizeof(double);
+	int num_postings = postings.doc_id.size();
+	double qmax = (1 << bow_quantisation) - 1;
+	postings.word_shift.resize(tf_idf.size());
+	if(bow_quantisation == 8)
+		postings.wgt_q8.resize(num_postings);
+	else
+		postings.wgt_q16.resize(num_postings);
+	for(uint word_id=0;word_id<tf_idf.size();word_id++)
+	{
+		//~ 2^shift brings the largest weight of the word in [0.5, 1)
+		double max_wgt = 0;
+		for(int h=word_offset[word_id];h<word_offset[word_id+1];h++)
+			max_wgt = std::max(max_wgt, wgt[h]);
+		int e = 0;
+		frexp(max_wgt, &e);
+		int shift = max_wgt > 0 ? std::min(BOWQUANT_MAXSHIFT, std::max(0, -e)) : BOWQUANT_MAXSHIFT;
+		postings.word_shift[word_id] = shift;
+		
+		for(int h=word_offset[word_id];h<word_offset[word_id+1];h++)
+		{
+			long q = lround(ldexp(wgt[h], shift) * qmax);
+			if(bow_quantisation == 8)
+				postings.wgt_q8[h] = q;
+			else
+				postings.wgt_q16[h] = q;
+		}
+	}
+	postings.quantisation_bits = bow_quantisation;
+	postings.tf_idf_doc_normed = index_array <double> ();
+	postings.wf_idf_doc_normed = index_array <double> ();
+	postings.ntf_idf_doc_normed = index_array <double> ();
+	
+	long quantised_bytes = num_postings * (bow_quantisation / 8) + postings.word_shift.size() * sizeof(int);
+	if(build_messages)
+		std::cout << "Quantised bag-of-words weights to " << bow_quantisation << " bits: " << double_bytes/1024 << " kB -> " << quantised_bytes/1024 << " kB" << std::endl;
+}
+
+// ---------------------------------------------------------
+
+//~ layout of an index file: header, section table, then the sections, each aligned to 8 bytes
+//~ version 1 files end at IDXSEC_BINOMIAL, their skip pointers and block-max bounds are built when they are loaded
+enum {IDXSEC_WORD_OFFSET, IDXSEC_POS_OFFSET, IDXSEC_DOC_ID, IDXSEC_TERM_COUNT, IDXSEC_TF_IDF, IDXSEC_NTF_IDF, IDXSEC_WF_IDF, IDXSEC_POS, 
+	IDXSEC_NORM_WGV, IDXSEC_IDF, IDXSEC_NUM_DOC, IDXSEC_BINOMIAL, IDXSEC_BLOCK_OFFSET, IDXSEC_BLOCK_LAST_DOC, IDXSEC_BLOCK_MAX_WGT, IDXSEC_WORD_MAX_WGT, IDXSEC_NUM};
+
+struct index_file_header
+{
+	char magic[8];
+	int32_t version, index_profile, bow_type, bow_subtype, wgv_kernel_size, max_bow_len, dictionary_dimensions, num_docs;
+	double alpha_vss;
+	uint64_t checksum;
+	struct {uint64_t offset, count;} section[IDXSEC_NUM];
+};
+
+static const size_t index_section_elsize[IDXSEC_NUM] = {sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(double), sizeof(double), sizeof(double), sizeof(int), 
+	sizeof(double), sizeof(double), sizeof(int), sizeof(double), sizeof(int), sizeof(int), sizeof(double), sizeof(double)};
+static const char index_file_magic[8] = {'G','F','L','I','P','I','D','X'};
+static const char wordscan_file_magic[8] = {'G','F','L','I','P','B','O','W'};
+
+//~ FNV-1a
+static uint64_t index_checksum(uint64_t h, const char *buf, size_t len)
+{
+	for(size_t i=0;i<len;i++)
+		h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+	return(h);
+}
+
+//~ bytes of the header of a file of this version
+static size_t index_header_size(int version)
+{
+	int num_sections = version < 2 ? IDXSEC_BLOCK_OFFSET : IDXSEC_NUM;
+	return(sizeof(index_file_header) - (IDXSEC_NUM - num_sections) * sizeof(index_file_header().section[0]));
+}
+
+static uint64_t index_checksum(const char *file, size_t len, int version)
+{
+	index_file_header hdr;
+	size_t hdr_size = index_header_size(version);
+	memcpy(&hdr, file, hdr_size);
+	hdr.checksum = 0;
+	uint64_t h = index_checksum(14695981039346656037ULL, (const char *)&hdr, hdr_size);
+	return(index_checksum(h, file + hdr_size, len - hdr_size));
+}
+
+// ---------------------------------------------------------
+
+//~ offsets of CSR sections: n+1 non-decreasing values from 0 to end
+static bool index_offsets_agree(const int *offset, uint64_t count, uint64_t n, uint64_t end)
+{
+	if(count != n + 1 || offset[0] != 0 || (uint64_t)offset[n] != end)
+		return(false);
+	for(uint64_t i=0;i<n;i++)
+		if(offset[i] > offset[i+1])
+			return(false);
+	return(true);
+}
+
+// ---------------------------------------------------------
+
+//~ the sections of an index file agree with each other and with the index profile of this engine, so that queries stay within them; 
+//~ full also checks every posting, which reads the posting sections as a whole
+bool gflip_engine::index_sections_agree(const char *file, const index_file_header &hdr, bool full) const
+{
+	#define IDXSEC_COUNT(k) hdr.section[k].count
+	#define IDXSEC_PTR(type, k) ((const type *)(file + hdr.section[k].offset))
+	uint64_t num_words = IDXSEC_COUNT(IDXSEC_IDF), num_postings = IDXSEC_COUNT(IDXSEC_DOC_ID);
+	bool agree = hdr.num_docs >= 0 && hdr.dictionary_dimensions >= 0 && (uint64_t)hdr.dictionary_dimensions == num_words && IDXSEC_COUNT(IDXSEC_NUM_DOC) == num_words 
+		&& index_offsets_agree(IDXSEC_PTR(int, IDXSEC_WORD_OFFSET), IDXSEC_COUNT(IDXSEC_WORD_OFFSET), num_words, num_postings);
+	
+	//~ per posting and per document sections of the profile
+	agree = agree && IDXSEC_COUNT(IDXSEC_TERM_COUNT) == (index_has_bow() ? num_postings : 0);
+	agree = agree && IDXSEC_COUNT(IDXSEC_TF_IDF) == (index_has_weights(0) ? num_postings : 0);
+	agree = agree && IDXSEC_COUNT(IDXSEC_WF_IDF) == (index_has_weights(1) ? num_postings : 0);
+	agree = agree && IDXSEC_COUNT(IDXSEC_NTF_IDF) == (index_has_weights(2) ? num_postings : 0);
+	if(index_has_gfp())
+		agree = agree && IDXSEC_COUNT(IDXSEC_NORM_WGV) == (uint64_t)hdr.num_docs && IDXSEC_COUNT(IDXSEC_POS_OFFSET) == num_postings + 1
+			&& (uint64_t)IDXSEC_PTR(int, IDXSEC_POS_OFFSET)[num_postings] == IDXSEC_COUNT(IDXSEC_POS);
+	
+	//~ skip pointers and block-max bounds, see build_posting_blocks
+	if(hdr.version >= 2 && agree)
+	{
+		uint64_t num_blocks = IDXSEC_COUNT(IDXSEC_BLOCK_LAST_DOC);
+		agree = index_offsets_agree(IDXSEC_PTR(int, IDXSEC_BLOCK_OFFSET), IDXSEC_COUNT(IDXSEC_BLOCK_OFFSET), num_words, num_blocks)
+			&& (IDXSEC_COUNT(IDXSEC_WORD_MAX_WGT) == 0 || IDXSEC_COUNT(IDXSEC_WORD_MAX_WGT) == num_words)
+			&& IDXSEC_COUNT(IDXSEC_BLOCK_MAX_WGT) == (IDXSEC_COUNT(IDXSEC_WORD_MAX_WGT) ? num_blocks : 0);
+	}
+	
+	if(full && agree)
+	{
+		const int *doc = IDXSEC_PTR(int, IDXSEC_DOC_ID);
+		for(uint64_t h=0;h<num_postings && agree;h++)
+			agree = doc[h] >= 0 && doc[h] < hdr.num_docs;
+		if(index_has_gfp())
+			agree = agree && index_offsets_agree(IDXSEC_PTR(int, IDXSEC_POS_OFFSET), IDXSEC_COUNT(IDXSEC_POS_OFFSET), num_postings, IDXSEC_COUNT(IDXSEC_POS));
 	}
-	//~ include last number
-	maxid+=1;
-	dictionary_dimensions = maxid;
-	//~ do it large
-	max_bow_len = (max_bow_len+1)*2;
-	std::cout << "Detected dictionary dimension: "<< maxid << " @ "<< maxid_idx << std::endl;
-	std::cout << "Detected max bow len : "<< max_bow_len << std::endl;
+	#undef IDXSEC_PTR
+	#undef IDXSEC_COUNT
+	return(agree);
+}
 
-	tf_idf = std::vector <tf_idf_db> (maxid);
-	for(int word_id=0; word_id<maxid; word_id++)
+// ---------------------------------------------------------
+
+int gflip_engine::save_index(std::string filename)
+{
+	if(postings.quantisation_bits)
 	{
-		//~ doc id
-		for(uint i=0;i<laserscan_bow.size();i++)
-		{
-			int term_count_unnormalized=0;
-			tf_idf_db_ordercache w_order;
-			for(uint j=0;j<laserscan_bow[i].w.size();j++)
-			{
-				if(laserscan_bow[i].w[j] == word_id)
-				{
-					term_count_unnormalized++;
-					w_order.pos.push_back(j);
-				}
-			}
-			//~ found a word match
-			if(term_count_unnormalized)
-			{
-				tf_idf[word_id].term_count_unnormalized.push_back(term_count_unnormalized);
-				tf_idf[word_id].num_words.push_back(laserscan_bow[i].w.size());
-				tf_idf[word_id].doc_id.push_back(i);
-				tf_idf[word_id].term_count.push_back((double)term_count_unnormalized / (double)laserscan_bow[i].w.size());
-				tf_idf[word_id].word_order.push_back(w_order);
-				tf_idf[word_id].tf_idf_doc_normed.push_back(-1);
-				tf_idf[word_id].wf_idf_doc_normed.push_back(-1);
-				tf_idf[word_id].ntf_idf_doc_normed.push_back(-1);
-			}
-		}
-		tf_idf[word_id].num_doc_containing_the_word = tf_idf[word_id].doc_id.size();
-		tf_idf[word_id].corpus_size = laserscan_bow.size();
-		tf_idf[word_id].idf = log( (double)tf_idf[word_id].corpus_size / (double) tf_idf[word_id].num_doc_containing_the_word );
+		std::cout << "Error: an index with quantised weights cannot be saved" << std::endl;
+		return(0);
 	}
 	
-	//~ tfsmoothing
-	std::vector < double > mxtf_val (laserscan_bow.size(),-DBL_MAX);
-	for(int doc_id=0;doc_id<(int)laserscan_bow.size();doc_id++)
+	//~ the file holds the main index only
+	if(num_delta_docs)
+		refresh();
+	
+	std::vector <double> idf (tf_idf.size());
+	std::vector <int> num_doc (tf_idf.size());
+	for(uint i=0;i<tf_idf.size();i++)
 	{
-		std::set<int> used_idx;
-		for(uint j=0;j<laserscan_bow[doc_id].w.size();j++)
-		{
-			int word_id = laserscan_bow[doc_id].w[j];
-			for(uint h=0; h<tf_idf[word_id].doc_id.size(); h++)
-				if(tf_idf[word_id].doc_id[h] == doc_id)
-					if( tf_idf[word_id].term_count_unnormalized[h] > mxtf_val [doc_id] )
-						mxtf_val[doc_id] = tf_idf[word_id].term_count_unnormalized[h];
-		}
-		//~ printf("%d %g %d\n",doc_id,mxtf_val,mxtf_idx);
+		idf[i] = tf_idf[i].idf;
+		num_doc[i] = tf_idf[i].num_doc_containing_the_word;
 	}
 	
-	//~ normedtfidf, wtfidf
-	for(int doc_id=0;doc_id<(int)laserscan_bow.size();doc_id++)
-	{
-		std::set<int> used_idx;
-		for(uint j=0;j<laserscan_bow[doc_id].w.size();j++)
-			used_idx.insert(laserscan_bow[doc_id].w[j]);
-		//~ sum
-		double sum=0,sum_wf=0,sum_vss=0;
-		for (std::set<int>::iterator word_id_iter=used_idx.begin(); word_id_iter!=used_idx.end(); word_id_iter++)
-			for(uint h=0;h<tf_idf[*word_id_iter].doc_id.size();h++)
-				if(tf_idf[*word_id_iter].doc_id[h] == doc_id)
-				{
-					double val = (tf_idf[*word_id_iter].term_count[h] * tf_idf[*word_id_iter].idf);
-					double val_wf = (1 + log(tf_idf[*word_id_iter].term_count_unnormalized[h]) ) * tf_idf[*word_id_iter].idf;
-					double val_vss = alpha_vss + ( (1.0 - alpha_vss) * tf_idf[*word_id_iter].term_count_unnormalized[h] ) / mxtf_val[doc_id];
-					sum+=val*val;
-					sum_wf+=val_wf*val_wf;
-					sum_vss+=val_vss*val_vss;
-				}
-					
-		//~ norm
-		double norm=sqrt(sum);
-		double norm_wf=sqrt(sum_wf);
-		double norm_vss=sqrt(sum_vss);
-		double versum=0, versum_wf=0, versum_vss=0;
-		for (std::set<int>::iterator word_id_iter=used_idx.begin(); word_id_iter!=used_idx.end(); word_id_iter++)
-			for(uint h=0;h<tf_idf[*word_id_iter].doc_id.size();h++)
-				if(tf_idf[*word_id_iter].doc_id[h] == doc_id)
-				{
-					tf_idf[*word_id_iter].tf_idf_doc_normed[h]=(tf_idf[*word_id_iter].term_count[h] * tf_idf[*word_id_iter].idf)/norm;
-					tf_idf[*word_id_iter].wf_idf_doc_normed[h]=((1 + log(tf_idf[*word_id_iter].term_count_unnormalized[h]) )  * tf_idf[*word_id_iter].idf)/norm_wf;
-					tf_idf[*word_id_iter].ntf_idf_doc_normed[h]=( alpha_vss + ( (1.0 - alpha_vss) * tf_idf[*word_id_iter].term_count_unnormalized[h] ) / mxtf_val[doc_id]) / norm_vss;
-					
-					versum += tf_idf[*word_id_iter].tf_idf_doc_normed[h]*tf_idf[*word_id_iter].tf_idf_doc_normed[h];
-					versum_wf += tf_idf[*word_id_iter].wf_idf_doc_normed[h]*tf_idf[*word_id_iter].wf_idf_doc_normed[h];
-					versum_vss += tf_idf[*word_id_iter].ntf_idf_doc_normed[h]*tf_idf[*word_id_iter].ntf_idf_doc_normed[h];
-				}
+	const void *data[IDXSEC_NUM] = {postings.word_offset.data(), postings.pos_offset.data(), postings.doc_id.data(), postings.term_count_unnormalized.data(), 
+		postings.tf_idf_doc_normed.data(), postings.ntf_idf_doc_normed.data(), postings.wf_idf_doc_normed.data(), postings.pos.data(), 
+		postings.norm_wgv.data(), idf.data(), num_doc.data(), cached_binomial_coeff.data(), 
+		postings.block_offset.data(), postings.block_last_doc.data(), postings.block_max_wgt.data(), postings.word_max_wgt.data()};
+	size_t count[IDXSEC_NUM] = {postings.word_offset.size(), postings.pos_offset.size(), postings.doc_id.size(), postings.term_count_unnormalized.size(), 
+		postings.tf_idf_doc_normed.size(), postings.ntf_idf_doc_normed.size(), postings.wf_idf_doc_normed.size(), postings.pos.size(), 
+		postings.norm_wgv.size(), idf.size(), num_doc.size(), cached_binomial_coeff.size(), 
+		postings.block_offset.size(), postings.block_last_doc.size(), postings.block_max_wgt.size(), postings.word_max_wgt.size()};
 	
-		//~ verification			
-		if( fabs(sqrt(versum) -1 ) > 0.00001 && sum > 0.00001 )
-		{
-			std::cout << "ERROR NORMALIZ FAIL "<<sqrt(versum)<< " "<< doc_id<< " "<< laserscan_bow[doc_id].w.size() << std::endl;
-			exit(1);
-		}
-		
-		if( fabs(sqrt(versum_wf) -1 ) > 0.00001 && sum_wf > 0.00001 )
-		{
-			std::cout << "ERROR WFIDF NORMALIZ FAIL "<<sqrt(versum_wf)<< " "<< doc_id<< " "<< laserscan_bow[doc_id].w.size() << std::endl;
-			exit(1);
-		}
+	index_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, index_file_magic, sizeof(hdr.magic));
+	hdr.version = INDEXFILE_VERSION;
+	hdr.index_profile = index_profile;
+	hdr.bow_type = bow_type;
+	hdr.bow_subtype = bow_subtype;
+	hdr.wgv_kernel_size = wgv_kernel_size;
+	hdr.max_bow_len = max_bow_len;
+	hdr.dictionary_dimensions = dictionary_dimensions;
+	hdr.num_docs = postings.num_docs;
+	hdr.alpha_vss = alpha_vss;
+	
+	//~ the whole file is assembled in memory to compute the checksum
+	uint64_t offset = (sizeof(hdr) + 7) & ~7ULL;
+	for(int k=0;k<IDXSEC_NUM;k++)
+	{
+		hdr.section[k].offset = offset;
+		hdr.section[k].count = count[k];
+		offset = (offset + count[k] * index_section_elsize[k] + 7) & ~7ULL;
+	}
+	std::vector <char> file (offset, 0);
+	memcpy(&file[0], &hdr, sizeof(hdr));
+	for(int k=0;k<IDXSEC_NUM;k++)
+		if(count[k])
+			memcpy(&file[hdr.section[k].offset], data[k], count[k] * index_section_elsize[k]);
+	hdr.checksum = index_checksum(&file[0], file.size(), INDEXFILE_VERSION);
+	memcpy(&file[0], &hdr, sizeof(hdr));
+	
+	FILE *f = fopen(filename.c_str(), "wb");
+	if(!f)
+	{
+		std::cout << "Error: cannot write index file " << filename << std::endl;
+		return(0);
+	}
+	size_t written = fwrite(&file[0], 1, file.size(), f);
+	if(fclose(f) != 0 || written != file.size())
+	{
+		std::cout << "Error: cannot write index file " << filename << std::endl;
+		return(0);
+	}
+	return(1);
+}
+
+// ---------------------------------------------------------
 
-		if( fabs(sqrt(versum_vss) -1 ) > 0.00001 && sum_vss > 0.00001 )
+int gflip_engine::load_index(std::string filename, bool verify)
+{
+	//~ the current mapping stays valid until the new index replaces it
+	mapped_file mf;
+	if(!mf.open(filename))
+	{
+		std::cout << "Error: cannot map index file " << filename << std::endl;
+		return(0);
+	}
+	
+	//~ the sections missing from older versions are empty
+	index_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	if(mf.size() < index_header_size(1))
+	{
+		std::cout << "Error: truncated index file " << filename << std::endl;
+		return(0);
+	}
+	memcpy(&hdr, mf.data(), index_header_size(1));
+	if(memcmp(hdr.magic, index_file_magic, sizeof(hdr.magic)) || hdr.version < 1 || hdr.version > INDEXFILE_VERSION)
+	{
+		std::cout << "Error: " << filename << " is not an index file of version " << INDEXFILE_VERSION << " or older" << std::endl;
+		return(0);
+	}
+	if(mf.size() < index_header_size(hdr.version))
+	{
+		std::cout << "Error: truncated index file " << filename << std::endl;
+		return(0);
+	}
+	memcpy(&hdr, mf.data(), index_header_size(hdr.version));
+	if(hdr.index_profile != index_profile || hdr.bow_type != bow_type || hdr.bow_subtype != bow_subtype || hdr.wgv_kernel_size != wgv_kernel_size || hdr.alpha_vss != alpha_vss)
+	{
+		std::cout << "Error: index file " << filename << " built with different parameters (profile " << hdr.index_profile << ", kernel " << hdr.wgv_kernel_size 
+			<< ", bag " << hdr.bow_type << ", TF-IDF flavour " << hdr.bow_subtype << ", alpha " << hdr.alpha_vss << ")" << std::endl;
+		return(0);
+	}
+	if(laserscan_bow.size() && (int)laserscan_bow.size() != hdr.num_docs)
+	{
+		std::cout << "Error: index file " << filename << " has " << hdr.num_docs << " scans, " << laserscan_bow.size() << " loaded" << std::endl;
+		return(0);
+	}
+	
+	for(int k=0;k<IDXSEC_NUM;k++)
+		if(hdr.section[k].offset % 8 || hdr.section[k].offset > mf.size() || hdr.section[k].count > (mf.size() - hdr.section[k].offset) / index_section_elsize[k])
 		{
-			std::cout << "ERROR VSSIDF NORMALIZ FAIL "<<sqrt(versum_vss)<< " "<< doc_id<< " "<< laserscan_bow[doc_id].w.size() << std::endl;
-			exit(1);
+			std::cout << "Error: corrupted index file " << filename << std::endl;
+				return(0);
 		}
+	if(verify && index_checksum(mf.data(), mf.size(), hdr.version) != hdr.checksum)
+	{
+		std::cout << "Error: checksum mismatch in index file " << filename << std::endl;
+		return(0);
+	}
+	if(!index_sections_agree(mf.data(), hdr, verify))
+	{
+		std::cout << "Error: inconsistent index file " << filename << std::endl;
+		return(0);
+	}
+	
+	index_file.swap(mf);
+	#define IDXSEC_DATA(type, k) (const type *)(index_file.data() + hdr.section[k].offset), hdr.section[k].count
+	postings = posting_index();
+	postings.num_docs = hdr.num_docs;
+	postings.word_offset.map(IDXSEC_DATA(int, IDXSEC_WORD_OFFSET));
+	postings.pos_offset.map(IDXSEC_DATA(int, IDXSEC_POS_OFFSET));
+	postings.doc_id.map(IDXSEC_DATA(int, IDXSEC_DOC_ID));
+	postings.term_count_unnormalized.map(IDXSEC_DATA(int, IDXSEC_TERM_COUNT));
+	postings.tf_idf_doc_normed.map(IDXSEC_DATA(double, IDXSEC_TF_IDF));
+	postings.ntf_idf_doc_normed.map(IDXSEC_DATA(double, IDXSEC_NTF_IDF));
+	postings.wf_idf_doc_normed.map(IDXSEC_DATA(double, IDXSEC_WF_IDF));
+	postings.pos.map(IDXSEC_DATA(int, IDXSEC_POS));
+	postings.norm_wgv.map(IDXSEC_DATA(double, IDXSEC_NORM_WGV));
+	postings.block_offset.map(IDXSEC_DATA(int, IDXSEC_BLOCK_OFFSET));
+	postings.block_last_doc.map(IDXSEC_DATA(int, IDXSEC_BLOCK_LAST_DOC));
+	
+	//~ block-max bounds only if this engine uses them and the file has them
+	if(index_has_block_max() && hdr.section[IDXSEC_WORD_MAX_WGT].count)
+	{
+		postings.block_max_wgt.map(IDXSEC_DATA(double, IDXSEC_BLOCK_MAX_WGT));
+		postings.word_max_wgt.map(IDXSEC_DATA(double, IDXSEC_WORD_MAX_WGT));
+	}
+	#undef IDXSEC_DATA
+	
+	max_bow_len = hdr.max_bow_len;
+	dictionary_dimensions = hdr.dictionary_dimensions;
+	const double *idf = (const double *)(index_file.data() + hdr.section[IDXSEC_IDF].offset);
+	const int *num_doc = (const int *)(index_file.data() + hdr.section[IDXSEC_NUM_DOC].offset);
+	tf_idf = std::vector <tf_idf_db> (hdr.section[IDXSEC_IDF].count);
+	for(uint i=0;i<tf_idf.size();i++)
+	{
+		tf_idf[i].idf = idf[i];
+		tf_idf[i].num_doc_containing_the_word = num_doc[i];
+		tf_idf[i].corpus_size = hdr.num_docs;
+	}
+	const double *binomial = (const double *)(index_file.data() + hdr.section[IDXSEC_BINOMIAL].offset);
+	cached_binomial_coeff.assign(binomial, binomial + hdr.section[IDXSEC_BINOMIAL].count);
+	
+	//~ queries of run_evaluation come from the loaded scans
+	if(bow_type==1)
+		reformulate_to_bagofdistances();
+	delta_postings = std::vector <delta_posting_list> (tf_idf.size());
+	num_delta_docs = 0;
+	prepared = true;
+	if(hdr.version < 2)
+		build_posting_blocks();
+	else if(index_has_block_max() && postings.word_max_wgt.empty())
+		build_block_max();
+	quantise_bow_weights();
+	
+	build_stats = index_build_stats();
+	build_stats.num_postings = postings.doc_id.size();
+	build_stats.index_memory_bytes = postings.memory_bytes();
+	return(1);
+}
+
+// ---------------------------------------------------------
 
+int mapped_file::open(std::string filename)
+{
+	close();
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		return(0);
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return(0);
 	}
+	void *a = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(a == MAP_FAILED)
+		return(0);
+	addr = a;
+	len = st.st_size;
+	return(1);
+}
 
-	//~ verification
-	for(uint i=0;i<tf_idf.size();i++)
-		for(uint h=0;h<tf_idf[i].doc_id.size();h++)
-		{
-			if(tf_idf[i].tf_idf_doc_normed[h] < 0)
-			{
-				std::cout << "ERROR NORMALIZ NO INT"<<std::endl;
-				exit(1);
-			}
-			if(tf_idf[i].wf_idf_doc_normed[h] < 0)
-			{
-				std::cout << "ERROR wf_idf NO INT"<< i << " "<< h << " "<< tf_idf[i].wf_idf_doc_normed[h] << " "<<  std::endl;
-				exit(1);
-			}
-			if(tf_idf[i].ntf_idf_doc_normed[h] < 0)
-			{
-				std::cout << "ERROR vss NO INT"<< i << " "<< h << " "<< tf_idf[i].ntf_idf_doc_normed[h] << " "<<  std::endl;
-				exit(1);
-			}
-			
-		}
+// ---------------------------------------------------------
+
+void mapped_file::swap(mapped_file &o)
+{
+	std::swap(addr, o.addr);
+	std::swap(len, o.len);
+}
+
+// ---------------------------------------------------------
+
+void mapped_file::close(void)
+{
+	if(addr)
+		munmap(addr, len);
+	addr = NULL;
+	len = 0;
 }
 
 // ---------------------------------------------------------
@@ -535,16 +2451,212 @@ void gflip_engine::insert_wordscan(std::vector <int> scanbow, std::vector <doubl
 		tmpbow.w_x[i] = xpos[i];
 		tmpbow.w_y[i] = ypos[i];
 	}
+	if(!prepared)
+	{
+		laserscan_bow.push_back(tmpbow);
+		number_of_scans = laserscan_bow.size();
+		return;
+	}
+	
+	if((int)laserscan_bow.size() != postings.num_docs)
+	{
+		std::cout << "Error: inserting in an index needs the " << postings.num_docs << " indexed scans, " << laserscan_bow.size() << " loaded" << std::endl;
+		exit(1);
+	}
+	if(bow_type==1)
+		reformulate_to_bagofdistances(tmpbow);
 	laserscan_bow.push_back(tmpbow);
 	number_of_scans = laserscan_bow.size();
+	index_wordscan();
+	
+	//~ opt-in: the caller gets the latency of a full build
+	if(max_stale_fraction >= 0 && num_delta_docs > max_stale_fraction * (postings.num_docs - num_delta_docs))
+	{
+		build_messages = false;
+		refresh();
+		build_messages = true;
+	}
+}
+
+// ---------------------------------------------------------
+
+void gflip_engine::index_wordscan(void)
+{
+	int doc_id = laserscan_bow.size()-1;
+	std::vector <int> &w = laserscan_bow[doc_id].w;
+	
+	//~ new words get empty postings in the main index
+	int maxid = w.size() ? *std::max_element(w.begin(), w.end()) + 1 : 0;
+	if(maxid > dictionary_dimensions)
+	{
+		tf_idf.resize(maxid);
+		delta_postings.resize(maxid);
+		while((int)postings.word_offset.size() < maxid+1)
+			postings.word_offset.push_back(postings.word_offset.back());
+		
+		//~ no posting blocks and a zero bound for block-max WAND, which scores their delta postings
+		while(!postings.block_offset.empty() && (int)postings.block_offset.size() < maxid+1)
+			postings.block_offset.push_back(postings.block_offset.back());
+		while(!postings.word_max_wgt.empty() && (int)postings.word_max_wgt.size() < maxid)
+			postings.word_max_wgt.push_back(0);
+		dictionary_dimensions = maxid;
+	}
+	
+	//~ room for the word order differences of this scan
+	if((int)w.size() >= max_bow_len/2)
+		max_bow_len = std::max(2*max_bow_len, ((int)w.size()+1)*2);
+	
+	//~ word orders grouped by word, words in id order as in the forward index
+	std::vector <int> order (w.size());
+	for(uint j=0;j<w.size();j++)
+		order[j] = j;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {return(w[a] < w[b]);});
+	
+	std::vector <int> word_id, term_count;
+	std::vector <char> indexed;
+	for(uint k=0;k<order.size();)
+	{
+		int wid = w[order[k]];
+		delta_posting_list &d = delta_postings[wid];
+		uint k_end = k;
+		while(k_end < order.size() && w[order[k_end]] == wid)
+			k_end++;
+		
+		//~ pruned words only count in the weights
+		word_id.push_back(wid);
+		term_count.push_back(k_end - k);
+		indexed.push_back(!word_pruned(wid));
+		
+		//~ the IDF of the other words stays the one of the last build until refresh()
+		if(tf_idf[wid].num_doc_containing_the_word == 0)
+		{
+			tf_idf[wid].corpus_size = postings.num_docs + 1;
+			tf_idf[wid].idf = log( (double)tf_idf[wid].corpus_size );
+		}
+		tf_idf[wid].num_doc_containing_the_word++;
+		if(!indexed.back())
+		{
+			k = k_end;
+			continue;
+		}
+		
+		d.doc_id.push_back(doc_id);
+		if(index_has_bow())
+			d.term_count_unnormalized.push_back(k_end - k);
+		if(index_has_gfp())
+		{
+			for(uint h=k;h<k_end;h++)
+				d.pos.push_back(order[h]);
+			d.pos_offset.push_back(d.pos.size());
+		}
+		k = k_end;
+	}
+	
+	if(index_has_bow())
+	{
+		int n = word_id.size();
+		std::vector <double> wgt (n), wgt_wf (n), wgt_vss (n);
+		tfidf_weights(doc_id, n, word_id.data(), term_count.data(), wgt.data(), wgt_wf.data(), wgt_vss.data());
+		for(int e=0;e<n;e++)
+		{
+			if(!indexed[e])
+				continue;
+			delta_posting_list &d = delta_postings[word_id[e]];
+			if(index_has_weights(0))
+				d.tf_idf_doc_normed.push_back(wgt[e]);
+			if(index_has_weights(1))
+				d.wf_idf_doc_normed.push_back(wgt_wf[e]);
+			if(index_has_weights(2))
+				d.ntf_idf_doc_normed.push_back(wgt_vss[e]);
+		}
+	}
+	
+	postings.num_docs++;
+	num_delta_docs++;
+	if(index_has_gfp())
+	{
+		std::vector <double> rc_idf_sum (max_bow_len);
+		std::vector <int> rc_weak_match (max_bow_len);
+		postings.norm_wgv.push_back(norm_gfp(w, rc_idf_sum, rc_weak_match));
+	}
+}
+// ---------------------------------------------------------
 
+//~ parses the text word scans in [begin, end), which starts at a line start; tokens are separated by spaces as in LSL_stringtoken
+//~ and converted in place with strtol/strtod (same results as atoi/atof), the buffer must be terminated by a non-number character.
+//~ Returns 0 if a line does not contain coordinates
+static int parse_wordscan_lines(const char *begin, const char *end, std::vector <scan_bow> &scans)
+{
+	const char *line = begin;
+	while(line < end)
+	{
+		const char *line_end = (const char *)memchr(line, '\n', end - line);
+		if(!line_end)
+			line_end = end;
+		
+		//~ count the tokens before allocating the scan
+		long numtokens = 0;
+		for(const char *p=line;p<line_end;)
+		{
+			while(p < line_end && *p == ' ')
+				p++;
+			if(p == line_end)
+				break;
+			numtokens++;
+			while(p < line_end && *p != ' ')
+				p++;
+		}
+		
+		if(numtokens)
+		{
+			const char *p = line;
+			while(*p == ' ')
+				p++;
+			uint numwords = strtol(p, NULL, 10);
+			if(numtokens != 1 + 3 * (long)numwords)
+				return(0);
+			
+			scans.push_back(scan_bow(numwords));
+			scan_bow &tmpbow = scans.back();
+			for(uint i=0;i<numwords*3;i++)
+			{
+				//~ next token
+				while(*p != ' ')
+					p++;
+				while(*p == ' ')
+					p++;
+				if(i % 3 == 0)
+					tmpbow.w[i/3] = strtol(p, NULL, 10);
+				else if(i % 3 == 1)
+					tmpbow.w_x[i/3] = strtod(p, NULL);
+				else
+					tmpbow.w_y[i/3] = strtod(p, NULL);
+			}
+		}
+		line = line_end + 1;
+	}
+	return(1);
 }
+
 // ---------------------------------------------------------
 
 int gflip_engine::read_wordscan_file(std::string filename)
 {
-	std::ifstream ifs(filename.c_str());
-	std::string line;
+	char magic[sizeof(wordscan_file_magic)] = {0};
+	std::ifstream ifs(filename.c_str(), std::ios::binary);
+	ifs.read(magic, sizeof(magic));
+	if(!memcmp(magic, wordscan_file_magic, sizeof(magic)))
+		return(read_wordscan_binary(filename));
+	
+	//~ whole file in memory, terminated by a 0 for strtol/strtod
+	ifs.clear();
+	ifs.seekg(0, std::ios::end);
+	long size = std::max((long)ifs.tellg(), 0L);
+	ifs.seekg(0);
+	std::vector <char> buffer (size+1, 0);
+	ifs.read(&buffer[0], size);
+	size = ifs.gcount();
+	const char *text = &buffer[0];
 
 	//~ getfilename
 	std::vector<std::string> ftokens;
@@ -552,36 +2664,37 @@ int gflip_engine::read_wordscan_file(std::string filename)
 	fileoutput_rootname = ftokens[ftokens.size()-1];
 	//~ std::cout<< fileoutput_rootname <<std::endl;
 
-    int count=0;
-	// index it
-	while( std::getline( ifs, line ) )
+	//~ every thread parses the lines starting in its chunk of the file, the scans are appended in chunk order
+	int nthreads = std::max(1, (int)std::min((long)num_threads, size / (1 << 20)));
+	std::vector < std::vector <scan_bow> > scans (nthreads);
+	std::vector <int> parsed (nthreads, 1);
+	parallel_ranges(size, nthreads, [&](long first, long last, int t)
 	{
-		std::vector <std::string> tokens;
-		LSL_stringtoken(line, tokens, " ");  
-	 
-		if(tokens.size())
+		while(first > 0 && first < size && text[first-1] != '\n')
+			first++;
+		while(last < size && text[last-1] != '\n')
+			last++;
+		if(first < last)
+			parsed[t] = parse_wordscan_lines(text + first, text + last, scans[t]);
+	});
+	
+	int count=0;
+	for(int t=0;t<nthreads;t++)
+	{
+		if(!parsed[t])
 		{
-			uint numwords=atoi(tokens[0].c_str());
-			scan_bow tmpbow(numwords);			
-			
-			if(tokens.size() != 1+numwords*3)
-			{
-				std::cout << "Error: input file must contain coordinates" << std::endl;
-				exit(1);
-			}
-			
- 			for(uint i=0, a=0;i<numwords*3;i+=3,a++)
-			{
-				tmpbow.w[a] = atoi(tokens[i+1].c_str());
-				tmpbow.w_x[a] = atof(tokens[i+1+1].c_str());
-				tmpbow.w_y[a] = atof(tokens[i+2+1].c_str());
-				//~ printf("%d ",tmpbow.w[a]);
- 			}
-			laserscan_bow.push_back(tmpbow);
-			count++;
- 
+			std::cout << "Error: input file must contain coordinates" << std::endl;
+			exit(1);
 		}
+		count += scans[t].size();
 	}
+	laserscan_bow.reserve(laserscan_bow.size() + count);
+	for(int t=0;t<nthreads;t++)
+		for(uint i=0;i<scans[t].size();i++)
+		{
+			laserscan_bow.push_back(scan_bow(0));
+			std::swap(laserscan_bow.back(), scans[t][i]);
+		}
 
 	//~ set num scans
 	number_of_scans = laserscan_bow.size();
@@ -591,6 +2704,197 @@ int gflip_engine::read_wordscan_file(std::string filename)
   
 // ---------------------------------------------------------
 
+//~ layout of a binary word scan file: header, num_scans+1 scan entries, word ids as LEB128 varints, coordinates
+struct wordscan_file_header
+{
+	char magic[8];
+	int32_t version, fixed_point;
+	double fixed_point_scale;
+	uint64_t num_scans, table_offset, words_offset, words_size, coords_offset;
+};
+
+//~ the words of scan i are the bytes [word_byte, next word_byte) of the varint stream, its coordinates the pairs [first_coord, next first_coord)
+struct wordscan_file_entry
+{
+	uint64_t word_byte, first_coord;
+};
+
+// ---------------------------------------------------------
+
+int gflip_engine::write_wordscan_binary(std::string filename, double fixed_point_scale)
+{
+	wordscan_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, wordscan_file_magic, sizeof(hdr.magic));
+	hdr.version = WORDSCANFILE_VERSION;
+	hdr.fixed_point = fixed_point_scale > 0;
+	hdr.fixed_point_scale = fixed_point_scale;
+	hdr.num_scans = laserscan_bow.size();
+	
+	std::vector <wordscan_file_entry> table (laserscan_bow.size()+1);
+	std::vector <unsigned char> words;
+	uint64_t num_coords = 0;
+	for(uint i=0;i<laserscan_bow.size();i++)
+	{
+		table[i].word_byte = words.size();
+		table[i].first_coord = num_coords;
+		for(uint j=0;j<laserscan_bow[i].w.size();j++)
+		{
+			uint32_t v = laserscan_bow[i].w[j];
+			while(v >= 0x80)
+			{
+				words.push_back((v & 0x7f) | 0x80);
+				v >>= 7;
+			}
+			words.push_back(v);
+		}
+		num_coords += laserscan_bow[i].w.size();
+	}
+	table[laserscan_bow.size()].word_byte = words.size();
+	table[laserscan_bow.size()].first_coord = num_coords;
+	
+	hdr.table_offset = sizeof(hdr);
+	hdr.words_offset = hdr.table_offset + table.size() * sizeof(wordscan_file_entry);
+	hdr.words_size = words.size();
+	hdr.coords_offset = (hdr.words_offset + words.size() + 7) & ~7ULL;
+	
+	FILE *f = fopen(filename.c_str(), "wb");
+	if(!f)
+	{
+		std::cout << "Error: cannot write word scan file " << filename << std::endl;
+		return(0);
+	}
+	char padding[8] = {0};
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	ok = ok && fwrite(&table[0], sizeof(wordscan_file_entry), table.size(), f) == table.size();
+	ok = ok && fwrite(words.data(), 1, words.size(), f) == words.size();
+	ok = ok && fwrite(padding, 1, hdr.coords_offset - hdr.words_offset - words.size(), f) == hdr.coords_offset - hdr.words_offset - words.size();
+	for(uint i=0;i<laserscan_bow.size() && ok;i++)
+		for(uint j=0;j<laserscan_bow[i].w.size() && ok;j++)
+		{
+			if(hdr.fixed_point)
+			{
+				int32_t xy[2] = {(int32_t)lround(laserscan_bow[i].w_x[j] / fixed_point_scale), (int32_t)lround(laserscan_bow[i].w_y[j] / fixed_point_scale)};
+				ok = fwrite(xy, sizeof(xy), 1, f) == 1;
+			}
+			else
+			{
+				float xy[2] = {(float)laserscan_bow[i].w_x[j], (float)laserscan_bow[i].w_y[j]};
+				ok = fwrite(xy, sizeof(xy), 1, f) == 1;
+			}
+		}
+	if(fclose(f) != 0 || !ok)
+	{
+		std::cout << "Error: cannot write word scan file " << filename << std::endl;
+		return(0);
+	}
+	return(1);
+}
+
+// ---------------------------------------------------------
+
+int gflip_engine::read_wordscan_binary(std::string filename)
+{
+	mapped_file mf;
+	if(!mf.open(filename))
+		return(0);
+	
+	//~ getfilename
+	std::vector<std::string> ftokens;
+	LSL_stringtoken(filename, ftokens, "/");
+	fileoutput_rootname = ftokens[ftokens.size()-1];
+	
+	wordscan_file_header hdr;
+	if(mf.size() < sizeof(hdr))
+	{
+		std::cout << "Error: truncated word scan file " << filename << std::endl;
+		exit(1);
+	}
+	memcpy(&hdr, mf.data(), sizeof(hdr));
+	if(memcmp(hdr.magic, wordscan_file_magic, sizeof(hdr.magic)) || hdr.version != WORDSCANFILE_VERSION)
+	{
+		std::cout << "Error: " << filename << " is not a version " << WORDSCANFILE_VERSION << " word scan file" << std::endl;
+		exit(1);
+	}
+	
+	//~ sizes are checked before touching the sections
+	uint64_t size = mf.size();
+	uint64_t coord_size = 2 * (hdr.fixed_point ? sizeof(int32_t) : sizeof(float));
+	if(hdr.table_offset > size || hdr.num_scans >= (size - hdr.table_offset) / sizeof(wordscan_file_entry) ||
+		hdr.words_offset > size || hdr.words_size > size - hdr.words_offset || hdr.coords_offset > size || hdr.coords_offset % 8)
+	{
+		std::cout << "Error: corrupted word scan file " << filename << std::endl;
+		exit(1);
+	}
+	const wordscan_file_entry *table = (const wordscan_file_entry *)(mf.data() + hdr.table_offset);
+	const unsigned char *words = (const unsigned char *)(mf.data() + hdr.words_offset);
+	const char *coords = mf.data() + hdr.coords_offset;
+	uint64_t num_coords = table[hdr.num_scans].first_coord;
+	if(table[hdr.num_scans].word_byte != hdr.words_size || num_coords > (size - hdr.coords_offset) / coord_size)
+	{
+		std::cout << "Error: corrupted word scan file " << filename << std::endl;
+		exit(1);
+	}
+	
+	laserscan_bow.reserve(laserscan_bow.size() + hdr.num_scans);
+	for(uint64_t i=0;i<hdr.num_scans;i++)
+	{
+		uint64_t b = table[i].word_byte, b_end = table[i+1].word_byte;
+		uint64_t c = table[i].first_coord, c_end = table[i+1].first_coord;
+		if(b > b_end || b_end > hdr.words_size || c > c_end || c_end > num_coords)
+		{
+			std::cout << "Error: corrupted word scan file " << filename << " at scan " << i << std::endl;
+			exit(1);
+		}
+		
+		scan_bow tmpbow(c_end - c);
+		for(uint a=0;a<c_end-c;a++)
+		{
+			uint32_t v = 0;
+			int shift = 0;
+			do
+			{
+				if(b >= b_end || shift > 28)
+				{
+					std::cout << "Error: corrupted word scan file " << filename << " at scan " << i << std::endl;
+					exit(1);
+				}
+				v |= (uint32_t)(words[b] & 0x7f) << shift;
+				shift += 7;
+			} while(words[b++] & 0x80);
+			tmpbow.w[a] = v;
+			
+			if(hdr.fixed_point)
+			{
+				int32_t xy[2];
+				memcpy(xy, coords + (c+a) * coord_size, sizeof(xy));
+				tmpbow.w_x[a] = xy[0] * hdr.fixed_point_scale;
+				tmpbow.w_y[a] = xy[1] * hdr.fixed_point_scale;
+			}
+			else
+			{
+				float xy[2];
+				memcpy(xy, coords + (c+a) * coord_size, sizeof(xy));
+				tmpbow.w_x[a] = xy[0];
+				tmpbow.w_y[a] = xy[1];
+			}
+		}
+		if(b != b_end)
+		{
+			std::cout << "Error: corrupted word scan file " << filename << " at scan " << i << std::endl;
+			exit(1);
+		}
+		laserscan_bow.push_back(tmpbow);
+	}
+	
+	//~ set num scans
+	number_of_scans = laserscan_bow.size();
+	
+	return(hdr.num_scans);
+}
+
+// ---------------------------------------------------------
+
 void LSL_stringtoken(const std::string& str, std::vector<std::string>& tokens, const std::string& delimiters)
 {
     // Skip delimiters at beginning.
@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <boost/math/special_functions/binomial.hpp>
 #include <sys/time.h>  
+#include <sys/resource.h>
+#include <stdint.h>
 #include <algorithm>
 
 
@@ -46,6 +48,26 @@
 #define DEFAULT_ALPHASMOOTH 0.4
 #define DEFAULT_BAGDISTANCE 0
 #define DEFAULT_CACHEBINOMIAL 10000
+#define DEFAULT_NUMTHREADS 1
+#define DEFAULT_INDEXPROFILE 0
+#define INDEXFILE_VERSION 2
+#define WORDSCANFILE_VERSION 1
+#define DEFAULT_FIXEDPOINT_SCALE 0.0001
+#define DEFAULT_MAXSTALEFRACTION -1
+#define DEFAULT_GFPENGINE 0
+#define DEFAULT_GFPROWMEMORY 4096
+#define DEFAULT_QUERYSHARDS 1
+#define DEFAULT_GFPPRUNING 0
+#define DEFAULT_PRUNEMINIDF 0
+#define DEFAULT_PRUNEMAXDF 1
+#define DEFAULT_BOWKERNEL 0
+#define DEFAULT_BOWQUANTISATION 0
+#define BOWQUANT_MAXSHIFT 24
+#define DEFAULT_BOWBLOCKMAX false
+#define POSTINGBLOCK_SIZE 64
+#define FILTER_DENSE_RATIO 4
+#define GFPPRUNING_SLACK 1e-9
+#define BOWBLOCKMAX_SLACK 1e-9
 
 /**
  * Contains a 2D scan represented by FLIRT words identified by their index, their (TF-IDF) weights, their norm for GFP
@@ -64,52 +86,343 @@ class scan_bow
 			w= std::vector <int> (no);
 			w_x = std::vector <double> (no);
 			w_y = std::vector <double> (no);
+			sum_weight = 0;
+			norm_wgv = 0;
 		}
 };
  
  
 
 /**
- * Caches the word orders in a scan for GFP indexing
+ * Contains the IDF of a FLIRT word, its postings are stored in \link posting_index\endlink
  * 
  * @author Luciano Spinello
  */	
-class tf_idf_db_ordercache
+class tf_idf_db
 {
 	public:
-		std::vector<int> pos;
+		//~ per term
+		int num_doc_containing_the_word, corpus_size;
+		double idf;
+		
+		tf_idf_db()
+		{
+			num_doc_containing_the_word = 0;
+			corpus_size = 0;
+			idf = 0;
+		}
 };
 
+/**
+ * Array of the search index: it either owns its elements or reads them from a memory mapped index file, see \link gflip_engine::load_index\endlink
+ */	
+template <class T> class index_array
+{
+	private:
+		std::vector <T> owned;
+		const T *ptr;
+		size_t n;
+		
+		//~ copies a mapped array, which is read only, before it is modified
+		void own(void)
+		{
+			if(is_mapped())
+			{
+				owned.assign(ptr, ptr+n);
+				ptr = owned.data();
+			}
+		}
+		
+	public:
+		index_array() {ptr = NULL; n = 0;}
+		index_array(const index_array &o) {*this = o;}
+		index_array & operator=(const index_array &o)
+		{
+			owned = o.owned;
+			n = o.n;
+			ptr = o.is_mapped() ? o.ptr : owned.data();
+			return(*this);
+		}
+		
+		//~ shrinking releases the memory
+		void resize(size_t sz, T val=T())
+		{
+			own();
+			bool shrink = sz < n;
+			owned.resize(sz, val);
+			if(shrink)
+				owned.shrink_to_fit();
+			ptr = owned.data(); 
+			n = sz;
+		}
+		
+		//~ a mapped array is copied before the first append
+		void push_back(const T &val)
+		{
+			own();
+			owned.push_back(val);
+			ptr = owned.data();
+			n = owned.size();
+		}
+		void map(const T *data, size_t sz) {std::vector <T>().swap(owned); ptr = data; n = sz;}
+		bool is_mapped(void) const {return(n > 0 && owned.empty());}
+		
+		//~ mapped arrays are copied before the first write access
+		T & operator[](size_t i) {own(); return(owned[i]);}
+		const T & operator[](size_t i) const {return(ptr[i]);}
+		const T * data(void) const {return(ptr);}
+		size_t size(void) const {return(n);}
+		bool empty(void) const {return(n == 0);}
+		const T & back(void) const {return(ptr[n-1]);}
+};
 
 /**
- * Contains TF-IDF weight for a  FLIRT word
+ * Read only memory mapping of a file, shared with the other processes mapping the same file
+ */	
+class mapped_file
+{
+	private:
+		void *addr;
+		size_t len;
+		mapped_file(const mapped_file &);
+		mapped_file & operator=(const mapped_file &);
+	
+	public:
+		mapped_file() {addr = NULL; len = 0;}
+		~mapped_file() {close();}
+		
+		/**
+		 * Maps \c filename, returns 0 on failure
+		 */
+		int open(std::string filename);
+		void close(void);
+		void swap(mapped_file &o);
+		const char * data(void) const {return((const char *)addr);}
+		size_t size(void) const {return(len);}
+};
+
+/**
+ * Inverted file in compressed sparse row layout
  * 
- * @author Luciano Spinello
+ * The postings of word \c w are in <tt>[word_offset[w], word_offset[w+1])</tt>, sorted by document; every posting \c p holds 
+ * its document, term count and the three TF-IDF weight flavours, and the word orders of the word in that document are in
+ * <tt>pos[pos_offset[p] .. pos_offset[p+1])</tt>
+ * 
+ * It also holds the GFP norm of every document. Arrays not needed by the index profile of the engine are left empty, see \link gflip_engine::gflip_engine\endlink
  */	
-class tf_idf_db
+class posting_index
 {
 	public:
-		//~ per doc
-		std::vector <tf_idf_db_ordercache> word_order;
-		std::vector <int> doc_id;
-		std::vector <int> term_count_unnormalized;
-		std::vector <double> tf_idf_doc_normed;
-		std::vector <double> ntf_idf_doc_normed;
-		std::vector <double> wf_idf_doc_normed;
-		std::vector <int> num_words;
-		std::vector <double> term_count;
+		int num_docs;
+		index_array <int> word_offset, pos_offset;
 		
-		//~ per term
-		int num_doc_containing_the_word, corpus_size;
+		//~ per posting
+		index_array <int> doc_id;
+		index_array <int> term_count_unnormalized;
+		index_array <double> tf_idf_doc_normed;
+		index_array <double> ntf_idf_doc_normed;
+		index_array <double> wf_idf_doc_normed;
+		
+		//~ word orders of all postings
+		index_array <int> pos;
+		
+		//~ quantised weights of one TF-IDF flavour, in place of the double ones, with the scale of each word, see gflip_engine::set_bow_quantisation
+		int quantisation_bits;
+		index_array <uint8_t> wgt_q8;
+		index_array <uint16_t> wgt_q16;
+		index_array <int> word_shift;
+		
+		//~ skip pointers: blocks of POSTINGBLOCK_SIZE postings, those of word w are [block_offset[w], block_offset[w+1]), with their last document;
+		//~ for block-max WAND also their largest weight and that of every word, see gflip_engine::set_bow_block_max
+		index_array <int> block_offset, block_last_doc;
+		index_array <double> block_max_wgt, word_max_wgt;
+		
+		//~ per document
+		index_array <double> norm_wgv;
+		
+		posting_index() {num_docs = 0; quantisation_bits = 0;}
+		
+		/**
+		 * Bytes used by the arrays
+		 */
+		long memory_bytes(void) const;
+};
+
+/**
+ * Postings of a FLIRT word for the scans inserted after the index was prepared, see \link gflip_engine::insert_wordscan\endlink
+ * 
+ * Same layout as the postings of a word in \link posting_index\endlink: the word orders of posting \c p are <tt>pos[pos_offset[p] .. pos_offset[p+1])</tt>
+ */	
+class delta_posting_list
+{
+	public:
+		std::vector <int> doc_id, term_count_unnormalized, pos_offset, pos;
+		std::vector <double> tf_idf_doc_normed, ntf_idf_doc_normed, wf_idf_doc_normed;
+		
+		delta_posting_list() {pos_offset.push_back(0);}
+};
+
+/**
+ * Forward index: for each document, the posting of each of its distinct words
+ * 
+ * The entries of document \c d are in <tt>[offset[d], offset[d+1])</tt>, sorted by word id; \c posting[e] is the index of the posting of \c word_id[e] in \link posting_index\endlink
+ */	
+class doc_postings_db
+{
+	public:
+		std::vector <int> offset, word_id, posting;
+};
+
+/**
+ * Word order match of a query word in a document for the hit stream GFP engine: \c key is <tt>doc * max_bow_len + order bin</tt>
+ */	
+class gfp_hit
+{
+	public:
+		uint64_t key;
 		double idf;
+};
+
+/**
+ * Cursor on the postings of a distinct query word for the block-max traversal of the bag-of-words engine: the posting \c pos in 
+ * <tt>[pos, last)</tt>, the block whose bound is used in <tt>[block, block_end)</tt>, and the multiplicity \c count of the word in the query
+ */	
+class bow_cursor
+{
+	public:
+		int word, pos, last, block, block_end, visited_block, count;
+		double max_wgt;
+};
+
+/**
+ * Timings and memory usage of the last index build, see \link gflip_engine::build_tfidf\endlink
+ */	
+class index_build_stats
+{
+	public:
+		double build_time, postings_time;
+		long num_postings, index_memory_bytes, peak_memory_kb;
 		
-		tf_idf_db()
+		//~ words whose postings were dropped, see gflip_engine::set_word_pruning
+		long num_pruned_words, num_pruned_postings;
+		
+		index_build_stats()
 		{
-			num_doc_containing_the_word = 0;
-			corpus_size = 0;
+			build_time = 0;
+			postings_time = 0;
+			num_postings = 0;
+			num_pruned_words = 0;
+			num_pruned_postings = 0;
+			index_memory_bytes = 0;
+			peak_memory_kb = 0;
 		}
 };
 
+/**
+ * Documents a query may match, as sorted disjoint ranges of scan indices, see \link gflip_engine::query\endlink
+ */	
+class doc_filter
+{
+	public:
+		//~ [first, last) ranges of allowed documents, and the bitmap they come from if any
+		std::vector < std::pair <int, int> > ranges;
+		std::vector <bool> bits;
+		
+		doc_filter() {}
+		
+		/**
+		 * Allows the documents in [first, last)
+		 */
+		doc_filter(int first, int last) {if(first < last) ranges.push_back(std::make_pair(first, last));}
+		
+		/**
+		 * Allows the documents whose bit is set
+		 */
+		doc_filter(const std::vector <bool> &allowed);
+		
+		/**
+		 * First allowed document from doc_idx on, INT_MAX if there is none
+		 */
+		int next_allowed(int doc_idx) const;
+		
+		/**
+		 * Number of allowed ranges that intersect [first, last]
+		 */
+		int num_ranges(int first, int last) const;
+};
+
+/**
+ * Scratch buffers and results of the queries of one thread, see \link gflip_engine::query\endlink
+ * 
+ * Queries do not modify a prepared engine, so any number of threads can query the same engine at once, each with its own context.
+ * The buffers are sized for the index by the first query and reused by the following ones
+ */	
+class query_context
+{
+	friend class gflip_engine;
+	private:
+		std::vector < std::pair <double, int> > scoreset;
+		int start_l, stop_l;
+		
+		//~ documents matched: [doc_first, doc_last), the per-document buffers are indexed from doc_first
+		int doc_first, doc_last;
+		std::vector <query_context> shard_contexts;
+		
+		//~ allowed documents within [doc_first, doc_last) when they are not all allowed
+		const doc_filter *filter;
+		
+		std::vector<double> mtchgfp_rc_idf_sum, normgfp_rc_idf_sum;
+		std::vector <int> mtchgfp_min_det_idx, mtchgfp_max_det_idx, mtchgfp_rc_weak_match, normgfp_rc_weak_match, mtchgfp_touched_docs;
+		std::vector<char> mtchgfp_used_doc_idx;
+		std::vector <gfp_hit> mtchgfp_hits, mtchgfp_hits_tmp;
+		
+		//~ BoW scores, zero outside of a query, with the documents touched by the query and the sorted query words
+		std::vector<double> mtchbow_scores;
+		std::vector<int64_t> mtchbow_int_scores;
+		std::vector<char> mtchbow_used_doc_idx;
+		std::vector <int> mtchbow_touched_docs, mtchbow_query_words;
+		
+		//~ block-max traversal: cursors of the distinct query words sorted by document in order, cursor of each query word, heap of the kbest 
+		//~ (raw score, document)
+		std::vector <bow_cursor> mtchbow_cursors;
+		std::vector <int> mtchbow_order, mtchbow_cursor_of;
+		std::vector < std::pair <double, int> > mtchbow_heap;
+		long num_blocks, num_skipped_blocks;
+		
+		//~ score bound pruning: query words by idf, deferred documents with their number of query words and idf mass, accumulated scores
+		std::vector<int> mtchgfp_order, mtchgfp_skipped_docs, mtchgfp_num_words;
+		std::vector<double> mtchgfp_idf_mass, mtchgfp_partial_score;
+		long num_postings, num_skipped_postings;
+		
+	public:
+		query_context() {start_l = 0; stop_l = 0; doc_first = 0; doc_last = INT_MAX; filter = NULL; num_postings = 0; num_skipped_postings = 0; num_blocks = 0; num_skipped_blocks = 0;}
+		
+		/**
+		 * Results of the last query run with this context: pairs of <scorematch, index of the scan in the dataset>, 
+		 * ranked as set with \link gflip_engine::set_full_ranking\endlink
+		 */
+		const std::vector < std::pair <double, int> > &results(void) const {return(scoreset);}
+		
+		/**
+		 * Postings traversed by the last bag-of-words query, or by the last GFP query run by the dense engine, with this context
+		 */
+		long get_num_postings(void) const {return(num_postings);}
+		
+		/**
+		 * Postings of the last GFP query that were not accumulated, see \link gflip_engine::set_gfp_pruning\endlink
+		 */
+		long get_num_skipped_postings(void) const {return(num_skipped_postings);}
+		
+		/**
+		 * Posting blocks of the query words and those skipped by the last bag-of-words query, see \link gflip_engine::set_bow_block_max\endlink
+		 */
+		long get_num_blocks(void) const {return(num_blocks);}
+		long get_num_skipped_blocks(void) const {return(num_skipped_blocks);}
+};
+
+//~ header of an index file, see gflip_engine::save_index
+struct index_file_header;
+
 /**
  * Geometrical FLIRT Phrases (GFP) for matching 2D laser scans represented FLIRT words
  * 
@@ -123,23 +436,67 @@ class gflip_engine
 	private:
 		//~ vars
 		std::vector <scan_bow> laserscan_bow;
-		std::vector < std::pair <double, int> > scoreset;
 		std::vector <tf_idf_db> tf_idf;
+		posting_index postings;
+		doc_postings_db doc_postings;
+		std::vector <delta_posting_list> delta_postings;
+		int num_delta_docs;
+		bool prepared, full_ranking, bow_block_max, build_messages;
+		double max_stale_fraction;
 		std::string fileoutput_rootname;
-		int dictionary_dimensions, start_l, stop_l, max_bow_len, wgv_kernel_size, bow_type, bow_subtype;
+		int dictionary_dimensions, max_bow_len, wgv_kernel_size, bow_type, bow_subtype, num_threads, index_profile, gfp_engine, query_shards, bow_kernel, bow_quantisation;
 		double anglethres, bow_dst_start, bow_dst_interval, bow_dst_end, alpha_vss;
 		uint number_of_scans, kbest;
-		std::vector<double> cached_binomial_coeff, mtchgfp_rc_idf_sum, normgfp_rc_idf_sum;
-		std::vector <int> mtchgfp_min_det_idx, mtchgfp_max_det_idx, mtchgfp_rc_weak_match, normgfp_rc_weak_match;
-		std::vector<char> mtchgfp_used_doc_idx;
+		std::vector<double> cached_binomial_coeff;
+		double gfp_pruning, prune_min_idf, prune_max_df;
+		long gfp_row_memory;
+		query_context default_context;
+		std::vector <query_context> batch_contexts;
+		index_build_stats build_stats;
+		mapped_file index_file;
 
 		//~ functions
- 		double norm_gfp(std::vector <int> & query_v);
- 		void matching_bow(std::vector <int> &query_v );
-		void matching_gfp(std::vector <int> &query_v );
+ 		double norm_gfp(const std::vector <int> & query_v, std::vector <double> &rc_idf_sum, std::vector <int> &rc_weak_match) const;
+ 		template <int K> double norm_gfp_k(const std::vector <int> & query_v, std::vector <double> &rc_idf_sum, std::vector <int> &rc_weak_match) const;
+ 		template <int K> double gfp_combo(int weak_match) const;
+ 		void matching_bow(const std::vector <int> &query_v, query_context &ctx) const;
+ 		template <int F> void matching_bow_f(const std::vector <int> &query_v, query_context &ctx) const;
+		template <int F> void matching_bow_wand(const std::vector <int> &query_v, query_context &ctx) const;
+		void matching_gfp(const std::vector <int> &query_v, query_context &ctx) const;
+		template <int K> void matching_gfp_k(const std::vector <int> &query_v, query_context &ctx) const;
+		template <int K> void matching_gfp_dense(const std::vector <int> &query_v, query_context &ctx) const;
+		template <int K> void matching_gfp_hits(const std::vector <int> &query_v, query_context &ctx) const;
+		void match(int dtype, const std::vector <int> &query_v, query_context &ctx) const;
+		void match_sharded(int dtype, const std::vector <int> &query_v, query_context &ctx) const;
+		void shard_postings(int word_id, const query_context &ctx, int &first, int &last, int &delta_first, int &delta_last) const;
+		int skip_postings(int word_id, int a, int last, int target) const;
+		template <class F> void allowed_postings(int word_id, const query_context &ctx, F visit) const;
+		int context_docs(const query_context &ctx) const {return(std::min(postings.num_docs, ctx.doc_last) - ctx.doc_first);}
+		int query_threads(int dtype, long num_queries) const;
+		void fit_context(query_context &ctx) const;
+		void rank_scores(query_context &ctx) const;
 		void voting_tfidf_weak_verificationOLD(std::vector <int> &query_v );		
 		void reformulate_to_bagofdistances(void);
+		void reformulate_to_bagofdistances(scan_bow &scan);
+		void build_index(void);
+		void index_wordscan(void);
 		void cache_binomial_coeff(void);
+		void count_postings(uint first, uint last, std::vector <int> &num_postings, std::vector <int> &num_pos);
+		void fill_postings(uint first, uint last, std::vector <int> &next_posting, std::vector <int> &next_pos);
+		void build_doc_postings(void);
+		void tfidf_weights(int doc_id, int n, const int *word_id, const int *term_count, double *wgt, double *wgt_wf, double *wgt_vss);
+		void normalise_tfidf(int first_doc, int last_doc);
+		void prune_words(void);
+		void quantise_bow_weights(void);
+		void build_posting_blocks(void);
+		void build_block_max(void);
+		bool word_pruned(int word_id) const;
+		bool index_sections_agree(const char *file, const index_file_header &hdr, bool full) const;
+		void check_index_profile(int dtype) const;
+		bool index_has_bow(void) const {return(index_profile != 2);}
+		bool index_has_gfp(void) const {return(index_profile != 1);}
+		bool index_has_weights(int flavour) const {return(index_has_bow() && (index_profile != 1 || flavour == bow_subtype));}
+		bool index_has_block_max(void) const {return(bow_block_max && !bow_quantisation && index_has_bow());}
 	
 	public:
 
@@ -147,12 +504,38 @@ class gflip_engine
 		/**
 		 * Reads file generated by FLIRTLIB in which each scan is described as a sequence of FLIRT words, represented each by a number
 		 * 
+		 * Large files are parsed in line aligned chunks by the threads set with \link gflip_engine::set_num_threads\endlink, scans keep the file order. 
+		 * Binary word scan files (see \link gflip_engine::write_wordscan_binary\endlink) are recognised and read with \link gflip_engine::read_wordscan_binary\endlink
 		 * @author Luciano Spinello
 		 */		 
  		int read_wordscan_file(std::string filename);
 
+		/**
+		 * Reads a binary word scan file, decoding the scans straight from a memory mapping of the file
+		 * 
+		 * @return number of scans read
+		 */		 
+ 		int read_wordscan_binary(std::string filename);
+
+		/**
+		 * Writes the word scans in the binary format
+		 * 
+		 * The file has a header, a table with the offsets of every scan, the word ids as LEB128 varints and the coordinates 
+		 * as interleaved x,y pairs, either as floats or as 32 bit fixed point values
+		 * @param filename output file
+		 * @param fixed_point_scale metres per unit of the fixed point coordinates, 0 stores floats
+		 * @return 1 on success, 0 otherwise
+		 */		 
+ 		int write_wordscan_binary(std::string filename, double fixed_point_scale=0);
+
 		/**
 		 * Inserts a scan described as a sequence of FLIRT words, represented each by a number 
+		 * 
+		 * After \link gflip_engine::prepare\endlink (or \link gflip_engine::load_index\endlink) the scan is indexed right away and can be matched by 
+		 * the next query. Its postings are appended to a delta index, using the IDF values of the last build (words new to the index get their 
+		 * IDF at the first insertion); IDF, weights and norms of the whole index are recomputed by \link gflip_engine::refresh\endlink. The caller 
+		 * runs it when convenient, e.g. from \link gflip_engine::get_num_stale_scans\endlink; an insertion runs it, without the build messages, only 
+		 * past the fraction set with \link gflip_engine::set_max_stale_fraction\endlink
 		 * @param wordscan scan identified as a sequence of ids
 		 * @param xpos,ypos metric position of each word in \c wordscan
 		 * @author Luciano Spinello
@@ -163,6 +546,8 @@ class gflip_engine
 		/**
 		 * Builds TF-IDF index for standard and weak verification matching methods
 		 * 
+		 * The inverted file (\link posting_index\endlink) is sized by a counting pass and filled in a single pass over the corpus; build time, index size and peak memory are kept in \link gflip_engine::get_build_stats\endlink
+		 * 
 		 * It implements IDF, TF, TF-IDF, wordcount and improved TF-IDF models proposed in:
 		 * <a href="http://comminfo.rutgers.edu/~muresan/IR/Docs/Articles/ipmSalton1988.pdf"> Gerard Salton and Christopher Buckley: "Term-weighting approaches in automatic text retrieval", Information processing & management, vol. 24, no. 5, 1988, Elsevier </a>
 		 * @author Luciano Spinello
@@ -174,6 +559,9 @@ class gflip_engine
 		 * 
 		 * Saves the k-best results on disk for each query along with computational time 
 		 * 
+		 * The queries are spread over the threads set with \link gflip_engine::set_num_threads\endlink as in \link gflip_engine::query_batch\endlink, 
+		 * and the results are written in scan order once all are done. Every thread has its own GFP accumulators (one row per scan with the dense engine, 
+		 * whose memory bounds the threads, see \link gflip_engine::set_gfp_row_memory\endlink)
 		 * @param dtype  kind of matching method: 1 standard bag-of-words, 2 geometrical FLIRT phrases
 		 * @author Luciano Spinello
 		 */
@@ -187,20 +575,231 @@ class gflip_engine
 		 * 
 		 * @param dtype  kind of matching method: 1 standard bag-of-words, 2 geometrical FLIRT phrases
 		 * @param query_v a query scan, composed by a vector of numbers, each indicating a FLIRT word
-		 * @param scoreoutput a pointer to a sorted vector of pairs containing <scorematch, index of the scan in the dataset>. 
+		 * @param scoreoutput a pointer to a vector of pairs containing <scorematch, index of the scan in the dataset>, valid until the next query:
+		 * only its first \c kbest entries are sorted, the others are in no particular order (all sorted with \link gflip_engine::set_full_ranking\endlink)
 		 * @author Luciano Spinello
 		 */
 		void query(int dtype, std::vector <int>   &query_v, std::vector < std::pair <double, int> > **scoreoutput);
 
+		/**
+		 * Matches a query scan with the dataset, keeping scratch buffers and results in \c ctx
+		 * 
+		 * Reentrant: threads can query the same prepared engine concurrently, each with its own context, as long as 
+		 * no other method changes the engine (reading, inserting scans, rebuilding the index or changing settings) meanwhile
+		 * @param dtype  kind of matching method: 1 standard bag-of-words, 2 geometrical FLIRT phrases
+		 * @param query_v a query scan, composed by a vector of numbers, each indicating a FLIRT word
+		 * @param ctx query context of the calling thread, the results are in \link query_context::results\endlink
+		 */
+		void query(int dtype, const std::vector <int> &query_v, query_context &ctx) const;
+
+		/**
+		 * Matches a query scan with the scans allowed by \c filter only, as \link gflip_engine::query\endlink does with all of them
+		 * 
+		 * The postings of the disallowed scans are not traversed: the matchers jump over them with the skip pointers of the index, 
+		 * so a filter with few ranges is cheaper than the whole dataset. The results list only allowed scans
+		 * @param dtype  kind of matching method: 1 standard bag-of-words, 2 geometrical FLIRT phrases
+		 * @param query_v a query scan, composed by a vector of numbers, each indicating a FLIRT word
+		 * @param filter scans that can be matched, e.g. a range of a session or a bitmap of the scans in an uncertainty region
+		 * @param ctx query context of the calling thread, the results are in \link query_context::results\endlink
+		 */
+		void query(int dtype, const std::vector <int> &query_v, const doc_filter &filter, query_context &ctx) const;
+
+		/**
+		 * Matches many query scans with the dataset on the threads set with \link gflip_engine::set_num_threads\endlink
+		 * 
+		 * Every thread has its own query context, kept for the next batches, and starts from its own block of queries; 
+		 * once done it takes the queries left in the blocks of the other threads, so that long and short queries balance out. 
+		 * GFP queries with the dense engine use only as many threads as \link gflip_engine::set_gfp_row_memory\endlink allows
+		 * @param dtype  kind of matching method: 1 standard bag-of-words, 2 geometrical FLIRT phrases
+		 * @param queries query scans, each a vector of FLIRT words
+		 * @param results for each query, in the order of \c queries, its \c kbest best matches as pairs of <scorematch, index of the scan in the dataset>
+		 * (all the matches with full ranking, see \link gflip_engine::set_full_ranking\endlink)
+		 */
+		void query_batch(int dtype, const std::vector < std::vector <int> > &queries, std::vector < std::vector < std::pair <double, int> > > &results);
+
 
 		/**
 		 * Prepares indeces and cache for matching. Executed once at the beginning.
 		 * Builds TF-IDF index for the dataset and norms all vectors on the dataset. Allocates also needed memory.
-		 * Optionally it generates bag-of-distances
+		 * Optionally it generates bag-of-distances. Only the structures used by the index profile are built.
 		 * @author Luciano Spinello
 		 */
 		void prepare(void);
 
+		/**
+		 * Rebuilds the index over all the scans, merging the scans inserted after the last build and recomputing IDF, weights and norms
+		 * 
+		 * Afterwards the results are the same as preparing the engine from scratch with all the scans
+		 */
+		void refresh(void);
+
+		/**
+		 * Sets how stale the index can get before \link gflip_engine::insert_wordscan\endlink runs \link gflip_engine::refresh\endlink itself
+		 * 
+		 * That insertion rebuilds the whole index before returning, so its latency grows with the dataset
+		 * @param f fraction of the indexed scans that can be inserted before refreshing, 0 refreshes after every insertion, a negative value refreshes only on request [DEFAULT]
+		 */
+		void set_max_stale_fraction(double f) {max_stale_fraction = f;}
+
+		/**
+		 * Selects how GFP scores are accumulated, both give the same results
+		 * @param e 0 dense per-document rows of word order bins, 1 stream of (document, bin) hits radix sorted by key and reduced run by run, 
+		 * whose working set depends only on the number of hits (faster on maps with millions of scans)
+		 */
+		void set_gfp_engine(int e) {gfp_engine = e;}
+
+		/**
+		 * Bounds the memory of the dense GFP rows of \link gflip_engine::query_batch\endlink and \link gflip_engine::run_evaluation\endlink
+		 * 
+		 * Every thread of a batch has its own rows, see \link gflip_engine::get_gfp_row_bytes\endlink, so the batch runs on fewer threads than set 
+		 * with \link gflip_engine::set_num_threads\endlink when their rows do not fit; the hit stream engine is not bounded
+		 * @param mb megabytes of dense rows of all the threads together, 0 does not bound them [4096 DEFAULT]
+		 */
+		void set_gfp_row_memory(long mb) {gfp_row_memory = mb;}
+
+		/**
+		 * Returns the bytes of the dense GFP rows of one query context over the whole dataset: two accumulators for each scan and word order bin, 
+		 * plus the per-scan state. Allocated by the first GFP query of the context with the dense engine and kept afterwards
+		 */
+		long get_gfp_row_bytes(void) const;
+
+		/**
+		 * Selects the kernel adding the posting weights to the scores in bag-of-words matching, all give the same results
+		 * @param k 0 AVX2 if the CPU supports it, scalar otherwise [DEFAULT], 1 scalar, 2 SSE4.1, 3 AVX2 gathers; a variant the CPU does not support falls back to the next one
+		 */
+		void set_bow_kernel(int k) {bow_kernel = k;}
+
+		/**
+		 * Returns the bag-of-words kernel used by the queries, as in \link gflip_engine::set_bow_kernel\endlink
+		 */
+		int get_bow_kernel(void) const;
+
+		/**
+		 * Stores the bag-of-words weights of the TF-IDF flavour of the engine as fixed point values, freeing the double weights of all the flavours; 
+		 * applied when the index is built or loaded
+		 * 
+		 * Every word has a power of two scale that brings its largest weight in [0.5, 1), so the weights of rare and common words keep the same 
+		 * relative precision, and the scores add up as 64 bit integers with a common scale. Scans inserted after the build keep double weights, 
+		 * quantised with the finest scale while matching. A quantised index cannot be saved, see \link gflip_engine::topk_overlap\endlink 
+		 * to compare its results with the double weights
+		 * @param bits 8 or 16, 0 keeps the double weights
+		 */
+		void set_bow_quantisation(int bits) {bow_quantisation = bits;}
+
+		/**
+		 * Retrieves only the \c kbest bag-of-words matches with a block-max WAND traversal, applied when the index is built or loaded
+		 * 
+		 * The postings of every word are split in blocks of POSTINGBLOCK_SIZE documents, each with its largest weight. The query walks the postings 
+		 * of its words document by document and skips the blocks whose bounds cannot beat the kbest-th score found so far. The kbest scores 
+		 * are the same as those of the exhaustive engine, but the result list holds only them. Not used with full ranking, kbest 0 or 
+		 * quantised weights; scans inserted after the build are scored exhaustively, see \link query_context::get_num_skipped_blocks\endlink
+		 * @param b true enables the traversal
+		 */
+		void set_bow_block_max(bool b) {bow_block_max = b;}
+
+		/**
+		 * Selects how much of the result list is ranked. By default only the \c kbest best matches are selected and sorted, 
+		 * the rest of the list holds all the other matched scans in no particular order
+		 * @param f true sorts the whole result list
+		 */
+		void set_full_ranking(bool f) {full_ranking = f;}
+
+		/**
+		 * Splits every single query (see \link gflip_engine::query\endlink) in ranges of scans matched each on its own thread, 
+		 * with its own accumulators, then merges the \c kbest best matches of the ranges. Meant to cut the latency of one query on maps of millions of scans, 
+		 * the results are the same as without shards. Batches and evaluations are parallel over the queries instead
+		 * @param n number of scan ranges, 1 matches the query on the calling thread
+		 */
+		void set_query_shards(int n) {query_shards = std::max(1, n);}
+
+		/**
+		 * Enables exact score bound pruning of GFP queries with the dense engine, when only the \c kbest best matches are ranked
+		 * 
+		 * The query words with the highest idf are essential: the documents they reach are scored first, and their \c kbest-th best score is a threshold 
+		 * no top-k match can be under. The postings of the other documents are only counted, which bounds their score by the idf mass of their hits 
+		 * and the binomial weight of a bin matching all the query words reaching them; the documents whose bound reaches the threshold are accumulated
+		 * in a second pass. The \c kbest best matches are the same as without pruning, the other matches listed are only the documents that were accumulated
+		 * @param essential_fraction fraction of the query words that are essential, 0 disables pruning
+		 */
+		void set_gfp_pruning(double essential_fraction) {gfp_pruning = essential_fraction;}
+
+		/**
+		 * Drops at build time the postings of the words that are in too many scans to tell them apart
+		 * 
+		 * Their idf is close to 0, so they add little to the scores, but their postings are the longest ones to traverse. The words keep their idf 
+		 * and the weights and norms of the scans are computed with all the words, only their matches are lost; scans inserted after the 
+		 * build do not index them either. An index saved after pruning stays pruned. See \link gflip_engine::topk_overlap\endlink to measure the effect on the results
+		 * @param min_idf words whose idf is under \c min_idf are dropped, 0 keeps all
+		 * @param max_df words in more than this fraction of the scans are dropped, 1 keeps all
+		 */
+		void set_word_pruning(double min_idf, double max_df) {prune_min_idf = min_idf; prune_max_df = max_df;}
+
+		/**
+		 * Fraction of the \c kbest best matches of the indexed scans, each used as query excluding itself as in \link gflip_engine::run_evaluation\endlink, 
+		 * that this engine shares with \c reference, e.g. the same scans indexed without \link gflip_engine::set_word_pruning\endlink
+		 * 
+		 * Runs on the threads set with \link gflip_engine::set_num_threads\endlink
+		 * @param dtype  kind of matching method: 1 standard bag-of-words, 2 geometrical FLIRT phrases
+		 * @param reference engine prepared with the same scans
+		 * @return matches shared over matches of \c reference, summed over all the queries
+		 */
+		double topk_overlap(int dtype, const gflip_engine &reference) const;
+
+		/**
+		 * Returns the number of scans read or inserted
+		 */
+		int get_num_scans(void) const {return(laserscan_bow.size());}
+
+		/**
+		 * Returns the FLIRT words of scan \c i, e.g. to use it as a query
+		 */
+		const std::vector <int> & get_wordscan(int i) const {return(laserscan_bow[i].w);}
+
+		/**
+		 * Returns the number of scans inserted since the last build
+		 */
+		int get_num_stale_scans(void) const {return(num_delta_docs);}
+
+		/**
+		 * Saves the prepared index to a versioned binary file
+		 * 
+		 * The file holds the postings, IDF values, per-scan norms, max bow length, dictionary dimension and binomial cache, the skip pointers 
+		 * and, when built, the block-max bounds (see \link gflip_engine::set_bow_block_max\endlink), followed by a checksum
+		 * @param filename output file
+		 * @return 1 on success, 0 otherwise
+		 */
+		int save_index(std::string filename);
+
+		/**
+		 * Loads an index written by \link gflip_engine::save_index\endlink, in place of \link gflip_engine::prepare\endlink
+		 * 
+		 * The file is memory mapped and the postings are read in place, so they are paged in on demand and shared by all the processes 
+		 * loading the same file, skip pointers and block-max bounds included (version 1 files have none, they are built at load time). 
+		 * The index must have been built with the same kernel size, bag-of-distances setting, TF-IDF flavour and index profile as this engine. 
+		 * Word scans read or inserted before loading must be the ones the index was built from.
+		 * 
+		 * The sizes of the sections and the word offsets are checked against each other and the index profile; with \c verify also the 
+		 * documents and word order offsets of every posting
+		 * @param filename index file
+		 * @param verify checks the checksum and every posting, which reads the whole file
+		 * @return 1 on success, 0 otherwise
+		 */
+		int load_index(std::string filename, bool verify=true);
+
+		/**
+		 * Returns timings, number of postings, pruned words and postings, index size and peak memory (kB) of the last index build
+		 */
+		const index_build_stats & get_build_stats(void) const {return(build_stats);}
+
+		/**
+		 * Sets the number of worker threads used by \link gflip_engine::prepare\endlink, \link gflip_engine::read_wordscan_file\endlink, 
+		 * \link gflip_engine::query_batch\endlink and \link gflip_engine::run_evaluation\endlink
+		 * 
+		 * Scans are split in contiguous blocks whose partial postings are merged in block order, so the index does not depend on the thread count
+		 * @param nt number of threads, 0 uses all the available cores
+		 */
+		void set_num_threads(int nt);
+
 		/**
 		 * Constructor
 		 * 
@@ -209,16 +808,33 @@ class gflip_engine
 		 * @param bt 1 for bag-of-distances, 0 otherwise
 		 * @param bstype flavor of TF-IDF in case of standard bag-of-words: 0 standard TFIDF, 1 sublinear TFIDF scaling, 2 lenght smoothing TFIDF, see \link gflip_engine::build_tfidf\endlink
 		 * @param a_vss alpha_smoothing in case of standard bag-of-words with lenght smoothing TFIDF (0.4 default)
+		 * @param prof index profile: 0 index for both matching methods, 1 standard bag-of-words only (weights of the \c bstype flavour, no word orders nor GFP norms), 2 GFP only (word orders and GFP norms, no TF-IDF weights)
 		 * @author Luciano Spinello
 		 */  
 
-		gflip_engine (int krnl, int kbt, int bt=DEFAULT_BAGDISTANCE, int bstype=DEFAULT_BOWSUBTYPE, double a_vss=DEFAULT_ALPHASMOOTH)
+		gflip_engine (int krnl, int kbt, int bt=DEFAULT_BAGDISTANCE, int bstype=DEFAULT_BOWSUBTYPE, double a_vss=DEFAULT_ALPHASMOOTH, int prof=DEFAULT_INDEXPROFILE)
 		{
 			bow_type = bt;
 			kbest = kbt;
 			wgv_kernel_size = krnl;
  			bow_subtype= bstype;
 			alpha_vss = a_vss;
+			num_threads = DEFAULT_NUMTHREADS;
+			index_profile = prof;
+			prepared = false;
+			full_ranking = false;
+			num_delta_docs = 0;
+			max_stale_fraction = DEFAULT_MAXSTALEFRACTION;
+			build_messages = true;
+			gfp_engine = DEFAULT_GFPENGINE;
+			gfp_row_memory = DEFAULT_GFPROWMEMORY;
+			query_shards = DEFAULT_QUERYSHARDS;
+			bow_kernel = DEFAULT_BOWKERNEL;
+			bow_quantisation = DEFAULT_BOWQUANTISATION;
+			bow_block_max = DEFAULT_BOWBLOCKMAX;
+			gfp_pruning = DEFAULT_GFPPRUNING;
+			prune_min_idf = DEFAULT_PRUNEMINIDF;
+			prune_max_df = DEFAULT_PRUNEMAXDF;
 			
 			//~ basic defaults for bag of distances
 			bow_dst_start= DEFAULT_BOWDST_START;
@@ -236,4 +852,14 @@ class gflip_engine
  */	
 void LSL_stringtoken(const std::string& str, std::vector<std::string>& tokens, const std::string& delimiters);
 bool isBettermatched(std::pair <double, int> x, std::pair <double, int> y); 
+
+/**
+ * Seconds elapsed since \c tim_st
+ */	
+double elapsed_since(const struct timeval &tim_st);
+
+/**
+ * Peak resident memory of the process in kB
+ */	
+long peak_memory_kb(void);
 #endif